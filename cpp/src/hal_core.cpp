@@ -2,10 +2,13 @@
 #include <SDL2/SDL_clipboard.h>
 #include <SDL2/SDL_rwops.h>
 #include <assert.h>
+#include <string.h>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <string>
+#include <vector>
 #ifdef __ANDROID__
 #include <jni.h>
 #endif
@@ -14,6 +17,8 @@
 #include "deque"
 #include "hal_core.h"
 #include "hal_palette.h"
+#include "hal_record.h"
+#include "simd.h"
 
 static SDL_Window* sdlWin = nullptr;
 static SDL_Renderer* sdlRen = nullptr;
@@ -23,11 +28,42 @@ static SDL_Joystick* joystick = nullptr;
 static int screenWidth = config::INIT_SCREEN_WIDTH;
 static int screenHeight = config::INIT_SCREEN_HEIGHT;
 
-static std::array<pixel_t, 256> original_palette;
-static std::array<pixel_t, 256> palette;
-
-static bool debug_trace_state = false;
+// palette colours as 0xrrggbb, converted to the texture format when the lookup table is built
+static std::array<uint32_t, 256> original_palette;
+static std::array<uint32_t, 256> palette;
+
+// read by the game thread in pipelined mode, changed here by F10
+static std::atomic<GFX_PresentMode> presentMode(GFX_PRESENT_RGB565);
+static Uint32 texFormat = SDL_PIXELFORMAT_RGB565;
+// wraps the core's buffer in GFX_PRESENT_INDEX8 mode, its palette is the fused screen palette
+static SDL_Surface* indexSurface = nullptr;
+
+// palette[screen_palette[i]] for the screen palette of the last GFX_CopyBackBuffer, so each
+// pixel is converted with a single lookup. entries are updated when the screen palette
+// changes, the whole table is rebuilt when the hal palette changes. only the table for the
+// current present mode is kept up to date.
+static std::array<pixel_t, 256> screen_lut;
+static std::array<uint32_t, 256> screen_lut32;
+static std::array<uint8_t, 256> screen_lut_palette;
+static bool screen_lut_valid = false;
+
+// state of the texture after the last GFX_CopyBackBuffer, any change to these forces a full copy
+static bool copy_all = true;
+static int copied_w = 0;
+static int copied_h = 0;
+// the buffer contents at the last copy, dirty rows that match it are not copied again
+static std::vector<uint8_t> copied_buffer(config::MAX_SCREEN_WIDTH* config::MAX_SCREEN_HEIGHT);
+
+// set when the texture, zoom or window changed since the last GFX_Flip, nothing is rendered
+// or presented while it is clear.
+static bool present_needed = true;
+
+// read by the game thread in pipelined mode
+static std::atomic<bool> debug_trace_state(false);
 static bool reload_requested = false;
+static std::atomic<bool> turbo_state(false);
+// performance counter value at GFX_Init, TIME_GetTime_us counts from here
+static uint64_t clock_start = 0;
 static std::string selectedPalette;
 
 static SDL_Point zoom_origin = SDL_Point{64, 64};
@@ -50,6 +86,7 @@ void GFX_Init(int x, int y) {
 	if (SDL_Init(init_flags) != 0) {
 		throw_error("SDL_Init Error: ");
 	}
+	clock_start = SDL_GetPerformanceCounter();
 
 	int window_flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
 #ifdef TAC08_FULL_SCREEN
@@ -98,6 +135,9 @@ void GFX_End() {
 	if (sdlTex) {
 		SDL_DestroyTexture(sdlTex);
 	}
+	if (indexSurface) {
+		SDL_FreeSurface(indexSurface);
+	}
 	SDL_Quit();
 }
 
@@ -108,34 +148,97 @@ void GFX_ToggleFullScreen() {
 #ifndef __ANDROID__
 	bool fullNow = (SDL_GetWindowFlags(sdlWin) & SDL_WINDOW_FULLSCREEN_DESKTOP) != 0;
 	SDL_SetWindowFullscreen(sdlWin, fullNow ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
+	present_needed = true;
 #endif
 }
 
 void GFX_SetFullScreen(bool fullscreen) {
 #ifndef __ANDROID__
 	SDL_SetWindowFullscreen(sdlWin, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+	present_needed = true;
 #endif
 }
 
-pixel_t GFX_GetPixel(uint8_t r, uint8_t g, uint8_t b) {
-	return (pixel_t)SDL_MapRGB(sdlPixFmt, r, g, b);
+static uint32_t GFX_GetPixel(uint32_t rgb) {
+	return SDL_MapRGB(sdlPixFmt, (rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff);
 }
 
-void GFX_CreateBackBuffer(int x, int y) {
-	GFX_SetBackBufferSize(x, y);
+// returns the first 32 bit format the renderer supports natively, so the driver does not have
+// to convert the texture again.
+static Uint32 getNativeFormat32() {
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(sdlRen, &info) == 0) {
+		for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+			switch (info.texture_formats[i]) {
+				case SDL_PIXELFORMAT_ARGB8888:
+				case SDL_PIXELFORMAT_RGB888:
+				case SDL_PIXELFORMAT_ABGR8888:
+				case SDL_PIXELFORMAT_BGR888:
+					return info.texture_formats[i];
+			}
+		}
+	}
+	return SDL_PIXELFORMAT_ARGB8888;
+}
+
+static void createTexture() {
+	if (sdlTex) {
+		SDL_DestroyTexture(sdlTex);
+	}
+	if (sdlPixFmt) {
+		SDL_FreeFormat(sdlPixFmt);
+	}
+
+	texFormat = presentMode == GFX_PRESENT_RGB565 ? SDL_PIXELFORMAT_RGB565 : getNativeFormat32();
 
-	sdlTex = SDL_CreateTexture(sdlRen, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING,
+	sdlTex = SDL_CreateTexture(sdlRen, texFormat, SDL_TEXTUREACCESS_STREAMING,
 	                           config::MAX_SCREEN_WIDTH, config::MAX_SCREEN_HEIGHT);
 	if (sdlTex == nullptr) {
 		throw_error("SDL_CreateTexture Error: ");
 	}
 
-	sdlPixFmt = SDL_AllocFormat(SDL_PIXELFORMAT_RGB565);
+	sdlPixFmt = SDL_AllocFormat(texFormat);
+	copy_all = true;
+	present_needed = true;
+	screen_lut_valid = false;
+}
+
+void GFX_CreateBackBuffer(int x, int y) {
+	GFX_SetBackBufferSize(x, y);
+
+	const char* mode = SDL_GetHint("TAC08_PRESENT_MODE");
+	if (mode != nullptr) {
+		std::string m = mode;
+		if (m == "argb8888") {
+			presentMode = GFX_PRESENT_ARGB8888;
+		} else if (m == "index8") {
+			presentMode = GFX_PRESENT_INDEX8;
+		} else {
+			presentMode = GFX_PRESENT_RGB565;
+		}
+	}
+	createTexture();
 
 	GFX_SelectPalette("pico8");
 }
 
+void GFX_SetPresentMode(GFX_PresentMode mode) {
+	if (mode != presentMode) {
+		presentMode = mode;
+		if (sdlTex) {
+			createTexture();
+		}
+	}
+}
+
+GFX_PresentMode GFX_GetPresentMode() {
+	return presentMode;
+}
+
 void GFX_SetBackBufferSize(int x, int y) {
+	if (x != screenWidth || y != screenHeight) {
+		present_needed = true;
+	}
 	screenWidth = x;
 	screenHeight = y;
 }
@@ -145,23 +248,25 @@ void GFX_SelectPalette(const std::string& name) {
 	selectedPalette = name;
 
 	for (size_t i = 0; i < pal.size; i++) {
-		auto p = pal.pal[i];
-		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
-		original_palette[i] = pix;
-		palette[i] = pix;
+		original_palette[i] = pal.pal[i] & 0xffffff;
+		palette[i] = original_palette[i];
 	}
+	screen_lut_valid = false;
 }
 
 void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
 	palette[to] = original_palette[from];
+	screen_lut_valid = false;
 }
 
 void GFX_RestorePaletteMapping() {
 	palette = original_palette;
+	screen_lut_valid = false;
 }
 
 void GFX_RestorePaletteMappingIndex(uint8_t i) {
 	palette[i] = original_palette[i];
+	screen_lut_valid = false;
 }
 
 void GFX_RestorePaletteRGB() {
@@ -171,42 +276,344 @@ void GFX_RestorePaletteRGB() {
 void GFX_RestorePaletteRGBIndex(uint8_t i) {
 	auto& pal = GFX_GetPaletteInfo(selectedPalette);
 	if (i < pal.size) {
-		auto p = pal.pal[i];
-		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
-		original_palette[i] = pix;
-		palette[i] = pix;
+		original_palette[i] = pal.pal[i] & 0xffffff;
+		palette[i] = original_palette[i];
+		screen_lut_valid = false;
 	}
 }
 
 void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
-	palette[i] = GFX_GetPixel(r, g, b);
+	palette[i] = (uint32_t(r) << 16) | (uint32_t(g) << 8) | b;
 	original_palette[i] = palette[i];
+	screen_lut_valid = false;
+}
+
+#if defined(TAC08_SIMD_SSSE3) || defined(TAC08_SIMD_NEON)
+static_assert(sizeof(pixel_t) == 2, "the vector kernels build 16 bit pixels from 2 byte tables");
+#endif
+
+// converts one row of the buffer through the fused lookup table. the vector kernels load the
+// low and high bytes of the first 16 table entries into registers and use them as byte shuffle
+// tables, then interleave the two results into pixels. blocks that contain colours >= 16 are
+// done with the scalar lookup.
+static void convertRow(pixel_t* pixels, const uint8_t* buffer, int w) {
+	int x = 0;
+#if defined(TAC08_SIMD_SSSE3)
+	alignas(16) uint8_t lo_bytes[16];
+	alignas(16) uint8_t hi_bytes[16];
+	for (int i = 0; i < 16; i++) {
+		lo_bytes[i] = screen_lut[i] & 0xff;
+		hi_bytes[i] = screen_lut[i] >> 8;
+	}
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i high = _mm_set1_epi8((char)0xf0);
+	const __m128i lo_lut = _mm_load_si128((const __m128i*)lo_bytes);
+	const __m128i hi_lut = _mm_load_si128((const __m128i*)hi_bytes);
+
+#if defined(TAC08_SIMD_AVX2)
+	const __m256i zero32 = _mm256_setzero_si256();
+	const __m256i high32 = _mm256_set1_epi8((char)0xf0);
+	const __m256i lo_lut32 = _mm256_broadcastsi128_si256(lo_lut);
+	const __m256i hi_lut32 = _mm256_broadcastsi128_si256(hi_lut);
+
+	for (; x + 32 <= w; x += 32) {
+		__m256i c = _mm256_loadu_si256((const __m256i*)(buffer + x));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(c, high32), zero32)) != -1) {
+			for (int n = 0; n < 32; n++) {
+				pixels[x + n] = screen_lut[buffer[x + n]];
+			}
+			continue;
+		}
+		__m256i lo = _mm256_shuffle_epi8(lo_lut32, c);
+		__m256i hi = _mm256_shuffle_epi8(hi_lut32, c);
+		// the unpacks work within each 128 bit lane, put the pixels back in order
+		__m256i a = _mm256_unpacklo_epi8(lo, hi);
+		__m256i b = _mm256_unpackhi_epi8(lo, hi);
+		_mm256_storeu_si256((__m256i*)(pixels + x), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*)(pixels + x + 16), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+#endif
+
+	for (; x + 16 <= w; x += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(buffer + x));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(c, high), zero)) != 0xffff) {
+			for (int n = 0; n < 16; n++) {
+				pixels[x + n] = screen_lut[buffer[x + n]];
+			}
+			continue;
+		}
+		__m128i lo = _mm_shuffle_epi8(lo_lut, c);
+		__m128i hi = _mm_shuffle_epi8(hi_lut, c);
+		_mm_storeu_si128((__m128i*)(pixels + x), _mm_unpacklo_epi8(lo, hi));
+		_mm_storeu_si128((__m128i*)(pixels + x + 8), _mm_unpackhi_epi8(lo, hi));
+	}
+#elif defined(TAC08_SIMD_NEON)
+	uint8_t lo_bytes[16];
+	uint8_t hi_bytes[16];
+	for (int i = 0; i < 16; i++) {
+		lo_bytes[i] = screen_lut[i] & 0xff;
+		hi_bytes[i] = screen_lut[i] >> 8;
+	}
+	const uint8x16_t lo_lut = vld1q_u8(lo_bytes);
+	const uint8x16_t hi_lut = vld1q_u8(hi_bytes);
+	const uint8x16_t limit = vdupq_n_u8(15);
+
+	for (; x + 16 <= w; x += 16) {
+		uint8x16_t c = vld1q_u8(buffer + x);
+		uint64x2_t any = vreinterpretq_u64_u8(vcgtq_u8(c, limit));
+		if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0) {
+			for (int n = 0; n < 16; n++) {
+				pixels[x + n] = screen_lut[buffer[x + n]];
+			}
+			continue;
+		}
+		uint8x16x2_t out;
+#if defined(__aarch64__)
+		out.val[0] = vqtbl1q_u8(lo_lut, c);
+		out.val[1] = vqtbl1q_u8(hi_lut, c);
+#else
+		uint8x8x2_t lo2 = {{vget_low_u8(lo_lut), vget_high_u8(lo_lut)}};
+		uint8x8x2_t hi2 = {{vget_low_u8(hi_lut), vget_high_u8(hi_lut)}};
+		out.val[0] = vcombine_u8(vtbl2_u8(lo2, vget_low_u8(c)), vtbl2_u8(lo2, vget_high_u8(c)));
+		out.val[1] = vcombine_u8(vtbl2_u8(hi2, vget_low_u8(c)), vtbl2_u8(hi2, vget_high_u8(c)));
+#endif
+		// interleaved store, low byte first, gives little endian pixels
+		vst2q_u8((uint8_t*)(pixels + x), out);
+	}
+#endif
+	for (; x < w; x++) {
+		pixels[x] = screen_lut[buffer[x]];
+	}
+}
+
+// 32 bit version of convertRow, each byte of the first 16 table entries gets its own shuffle
+// table and the four results are interleaved into pixels.
+static void convertRow32(uint32_t* pixels, const uint8_t* buffer, int w) {
+	int x = 0;
+#if defined(TAC08_SIMD_SSSE3)
+	alignas(16) uint8_t bytes[4][16];
+	for (int i = 0; i < 16; i++) {
+		for (int b = 0; b < 4; b++) {
+			bytes[b][i] = (screen_lut32[i] >> (b * 8)) & 0xff;
+		}
+	}
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i high = _mm_set1_epi8((char)0xf0);
+	const __m128i lut0 = _mm_load_si128((const __m128i*)bytes[0]);
+	const __m128i lut1 = _mm_load_si128((const __m128i*)bytes[1]);
+	const __m128i lut2 = _mm_load_si128((const __m128i*)bytes[2]);
+	const __m128i lut3 = _mm_load_si128((const __m128i*)bytes[3]);
+
+	for (; x + 16 <= w; x += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*)(buffer + x));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(c, high), zero)) != 0xffff) {
+			for (int n = 0; n < 16; n++) {
+				pixels[x + n] = screen_lut32[buffer[x + n]];
+			}
+			continue;
+		}
+		__m128i b0 = _mm_shuffle_epi8(lut0, c);
+		__m128i b1 = _mm_shuffle_epi8(lut1, c);
+		__m128i b2 = _mm_shuffle_epi8(lut2, c);
+		__m128i b3 = _mm_shuffle_epi8(lut3, c);
+		__m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+		__m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+		__m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+		__m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+		_mm_storeu_si128((__m128i*)(pixels + x), _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i*)(pixels + x + 4), _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i*)(pixels + x + 8), _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128((__m128i*)(pixels + x + 12), _mm_unpackhi_epi16(hi01, hi23));
+	}
+#elif defined(TAC08_SIMD_NEON)
+	uint8_t bytes[4][16];
+	for (int i = 0; i < 16; i++) {
+		for (int b = 0; b < 4; b++) {
+			bytes[b][i] = (screen_lut32[i] >> (b * 8)) & 0xff;
+		}
+	}
+	uint8x16_t luts[4];
+	for (int b = 0; b < 4; b++) {
+		luts[b] = vld1q_u8(bytes[b]);
+	}
+	const uint8x16_t limit = vdupq_n_u8(15);
+
+	for (; x + 16 <= w; x += 16) {
+		uint8x16_t c = vld1q_u8(buffer + x);
+		uint64x2_t any = vreinterpretq_u64_u8(vcgtq_u8(c, limit));
+		if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0) {
+			for (int n = 0; n < 16; n++) {
+				pixels[x + n] = screen_lut32[buffer[x + n]];
+			}
+			continue;
+		}
+		uint8x16x4_t out;
+		for (int b = 0; b < 4; b++) {
+#if defined(__aarch64__)
+			out.val[b] = vqtbl1q_u8(luts[b], c);
+#else
+			uint8x8x2_t lut2 = {{vget_low_u8(luts[b]), vget_high_u8(luts[b])}};
+			out.val[b] = vcombine_u8(vtbl2_u8(lut2, vget_low_u8(c)), vtbl2_u8(lut2, vget_high_u8(c)));
+#endif
+		}
+		vst4q_u8((uint8_t*)(pixels + x), out);
+	}
+#endif
+	for (; x < w; x++) {
+		pixels[x] = screen_lut32[buffer[x]];
+	}
 }
 
-void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h, const std::array<uint8_t, 256>& screen_palette) {
-	pixel_t* pixels;
+// converts rows y0 to y1 - 1 of the buffer into the texture
+static void copyRows(const uint8_t* buffer, int buffer_w, int y0, int y1) {
+	uint8_t* pixels;
 	int pitch;
 
-	SDL_Rect r = {0, 0, buffer_w, buffer_h};
+	SDL_Rect r = {0, y0, buffer_w, y1 - y0};
 
 	int res = SDL_LockTexture(sdlTex, &r, (void**)&pixels, &pitch);
 	if (res < 0) {
 		throw_error("SDL_LockTexture Error: ");
 	}
 
-	for (int y = 0; y < buffer_h; y++) {
-		for (int x = 0; x < buffer_w; x++) {
-			pixels[x] = palette[screen_palette[buffer[x]]];
-			x++;
-			pixels[x] = palette[screen_palette[buffer[x]]];
+	buffer += y0 * buffer_w;
+	switch (presentMode) {
+		case GFX_PRESENT_RGB565:
+			for (int y = y0; y < y1; y++) {
+				convertRow((pixel_t*)pixels, buffer, buffer_w);
+				pixels += pitch;
+				buffer += buffer_w;
+			}
+			break;
+		case GFX_PRESENT_ARGB8888:
+			for (int y = y0; y < y1; y++) {
+				convertRow32((uint32_t*)pixels, buffer, buffer_w);
+				pixels += pitch;
+				buffer += buffer_w;
+			}
+			break;
+		case GFX_PRESENT_INDEX8: {
+			// sdl converts the rows of the wrapped buffer straight into the locked texture
+			SDL_Surface* dst = SDL_CreateRGBSurfaceWithFormatFrom(pixels, buffer_w, y1 - y0, 32, pitch,
+			                                                      texFormat);
+			if (dst == nullptr) {
+				SDL_UnlockTexture(sdlTex);
+				throw_error("SDL_CreateRGBSurfaceWithFormatFrom Error: ");
+			}
+			SDL_Rect src = {0, y0, buffer_w, y1 - y0};
+			SDL_BlitSurface(indexSurface, &src, dst, nullptr);
+			SDL_FreeSurface(dst);
+			break;
 		}
-		pixels += pitch / sizeof(pixel_t);
-		buffer += buffer_w;
 	}
 
 	SDL_UnlockTexture(sdlTex);
 }
 
+static void setScreenLutEntry(int i, uint32_t rgb) {
+	switch (presentMode) {
+		case GFX_PRESENT_RGB565:
+			screen_lut[i] = (pixel_t)GFX_GetPixel(rgb);
+			break;
+		case GFX_PRESENT_ARGB8888:
+			screen_lut32[i] = GFX_GetPixel(rgb);
+			break;
+		case GFX_PRESENT_INDEX8: {
+			SDL_Color c = {Uint8(rgb >> 16), Uint8(rgb >> 8), Uint8(rgb), 255};
+			SDL_SetPaletteColors(indexSurface->format->palette, &c, i, 1);
+			break;
+		}
+	}
+}
+
+// brings the fused lookup table up to date, returns true if any entry changed
+static bool updateScreenLut(const std::array<uint8_t, 256>& screen_palette) {
+	if (!screen_lut_valid) {
+		for (int i = 0; i < 256; i++) {
+			setScreenLutEntry(i, palette[screen_palette[i]]);
+		}
+		screen_lut_palette = screen_palette;
+		screen_lut_valid = true;
+		return true;
+	}
+
+	bool changed = false;
+	for (int i = 0; i < 256; i++) {
+		if (screen_lut_palette[i] != screen_palette[i]) {
+			screen_lut_palette[i] = screen_palette[i];
+			setScreenLutEntry(i, palette[screen_palette[i]]);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// wraps the core's buffer in an 8 bit surface for GFX_PRESENT_INDEX8, the surface only
+// changes when the buffer does.
+static void updateIndexSurface(uint8_t* buffer, int buffer_w, int buffer_h) {
+	if (indexSurface && indexSurface->w == buffer_w && indexSurface->h == buffer_h) {
+		// the pipelined mode hands over a different buffer each frame, same layout
+		indexSurface->pixels = buffer;
+		return;
+	}
+	if (indexSurface) {
+		SDL_FreeSurface(indexSurface);
+	}
+	indexSurface = SDL_CreateRGBSurfaceWithFormatFrom(buffer, buffer_w, buffer_h, 8, buffer_w,
+	                                                  SDL_PIXELFORMAT_INDEX8);
+	if (indexSurface == nullptr) {
+		throw_error("SDL_CreateRGBSurfaceWithFormatFrom Error: ");
+	}
+	// the new surface has its own palette
+	screen_lut_valid = false;
+}
+
+void GFX_CopyBackBuffer(uint8_t* buffer,
+                        int buffer_w,
+                        int buffer_h,
+                        const std::array<uint8_t, 256>& screen_palette,
+                        const uint8_t* dirty_rows) {
+	if (presentMode == GFX_PRESENT_INDEX8) {
+		updateIndexSurface(buffer, buffer_w, buffer_h);
+	}
+
+	bool lut_changed = updateScreenLut(screen_palette);
+	bool all = copy_all || lut_changed || dirty_rows == nullptr || buffer_w != copied_w ||
+	           buffer_h != copied_h;
+
+	// rows that were drawn to but ended up the same as last time do not need copying, carts
+	// that redraw an unchanged screen every frame then do not cause a present.
+	std::array<bool, config::MAX_SCREEN_HEIGHT> changed;
+	for (int y = 0; y < buffer_h; y++) {
+		uint8_t* row = buffer + y * buffer_w;
+		uint8_t* copied_row = copied_buffer.data() + y * buffer_w;
+		changed[y] = all || (dirty_rows[y] && memcmp(row, copied_row, buffer_w) != 0);
+		if (changed[y]) {
+			memcpy(copied_row, row, buffer_w);
+		}
+	}
+
+	// copy each run of changed rows with a single lock
+	int y = 0;
+	while (y < buffer_h) {
+		if (!changed[y]) {
+			y++;
+			continue;
+		}
+		int y1 = y + 1;
+		while (y1 < buffer_h && changed[y1]) {
+			y1++;
+		}
+		copyRows(buffer, buffer_w, y, y1);
+		present_needed = true;
+		y = y1;
+	}
+
+	copy_all = false;
+	copied_w = buffer_w;
+	copied_h = buffer_h;
+}
+
 void GFX_ShowHWMouse(bool show) {
 	SDL_ShowCursor(show);
 }
@@ -216,6 +623,9 @@ void GFX_GetDisplayArea(int* w, int* h) {
 }
 
 void GFX_SetZoom(int x, int y, double factor, double rot) {
+	if (x != zoom_origin.x || y != zoom_origin.y || factor != zoom_factor || rot != zoom_rot) {
+		present_needed = true;
+	}
 	zoom_origin.x = x;
 	zoom_origin.y = y;
 	zoom_factor = factor;
@@ -245,6 +655,11 @@ static SDL_Rect getDisplayArea(SDL_Window* win, double* scale = nullptr) {
 }
 
 void GFX_Flip() {
+	if (!present_needed) {
+		return;
+	}
+	present_needed = false;
+
 	SDL_Rect dr = getDisplayArea(sdlWin);
 	SDL_Rect sr = {0, 0, screenWidth, screenHeight};
 
@@ -289,6 +704,9 @@ bool INP_TouchAvailable() {
 }
 
 uint8_t INP_GetTouchMask() {
+	if (REC_Replaying()) {
+		return REC_ReplayedFrame().touch_mask;
+	}
 	uint8_t mask = 0;
 	for (size_t n = 0; n < touchState.size(); n++) {
 		if (touchState[n].state != TouchInfo::None) {
@@ -299,6 +717,10 @@ uint8_t INP_GetTouchMask() {
 }
 
 TouchInfo INP_GetTouchInfo(int idx) {
+	if (REC_Replaying()) {
+		const FrameInput& replayed = REC_ReplayedFrame();
+		return idx >= 0 && idx < (int)replayed.touches.size() ? replayed.touches[idx] : TouchInfo{};
+	}
 	if (idx < 0 && idx >= (int)touchState.size()) {
 		return TouchInfo{};
 	} else {
@@ -352,6 +774,9 @@ static void addKeyPress(const std::string& k) {
 }
 
 std::string INP_GetKeyPress() {
+	if (REC_Replaying()) {
+		return REC_ReplayedKeyPress();
+	}
 	if (!SDL_IsTextInputActive()) {
 #ifndef __ANDROID__
 		SDL_StartTextInput();
@@ -395,6 +820,15 @@ bool INP_ProcessInputEvents(const SDL_Event& ev) {
 		reload_requested = true;
 		return true;
 	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F9) {
+		DEBUG_Turbo(!DEBUG_Turbo());
+		return true;
+	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F10) {
+		// cycle the present modes, for comparing their cost with the trace output
+		GFX_SetPresentMode(GFX_PresentMode((GFX_GetPresentMode() + 1) % 3));
+		return true;
+	}
 	if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP) {
 		set_state_bit(keyState, 0, ev.key.keysym.sym == SDLK_LEFT, ev.type == SDL_KEYDOWN);
 		set_state_bit(keyState, 1, ev.key.keysym.sym == SDLK_RIGHT, ev.type == SDL_KEYDOWN);
@@ -435,6 +869,10 @@ bool EVT_ProcessEvents() {
 	while (SDL_PollEvent(&e)) {
 		if (e.type == SDL_QUIT) {
 			return false;
+		} else if (e.type == SDL_WINDOWEVENT || e.type == SDL_RENDER_TARGETS_RESET ||
+		           e.type == SDL_RENDER_DEVICE_RESET) {
+			// the window contents may be gone or need scaling again
+			present_needed = true;
 		} else {
 			if (!INP_ProcessInputEvents(e)) {
 				return false;
@@ -444,6 +882,16 @@ bool EVT_ProcessEvents() {
 	return true;
 }
 
+void EVT_WaitEvents(uint64_t us) {
+	uint64_t end = TIME_GetTime_us() + us;
+	if (us >= 1000 && SDL_WaitEventTimeout(nullptr, int(us / 1000))) {
+		// an event arrived, return so it can be handled
+		return;
+	}
+	while (TIME_GetTime_us() < end) {
+	}
+}
+
 uint8_t INP_GetInputState() {
 	return keyState | joyState | hatState | simState;
 }
@@ -478,6 +926,22 @@ void TIME_Sleep(int ms) {
 	SDL_Delay(ms);
 }
 
+uint64_t TIME_GetTime_us() {
+	uint64_t freq = SDL_GetPerformanceFrequency();
+	uint64_t t = SDL_GetPerformanceCounter() - clock_start;
+	// split so the multiply does not overflow for high frequency counters
+	return (t / freq) * 1000000 + ((t % freq) * 1000000) / freq;
+}
+
+void TIME_Sleep_us(uint64_t us) {
+	uint64_t end = TIME_GetTime_us() + us;
+	// SDL_Delay only has millisecond resolution, sleep the whole milliseconds and spin for the
+	// rest so frame deadlines are met without burning a core.
+	SDL_Delay(uint32_t(us / 1000));
+	while (TIME_GetTime_us() < end) {
+	}
+}
+
 static void scaleMouse(int& x, int& y) {
 	double scale;
 	SDL_Rect r = getDisplayArea(sdlWin, &scale);
@@ -488,6 +952,9 @@ static void scaleMouse(int& x, int& y) {
 }
 
 MouseState INP_GetMouseState() {
+	if (REC_Replaying()) {
+		return REC_ReplayedFrame().mouse;
+	}
 	MouseState ms;
 
 	int b = SDL_GetMouseState(&ms.x, &ms.y);
@@ -570,10 +1037,11 @@ void HAL_EndFrame() {
 	flushTouchEvents();
 }
 
-static uint32_t target_fps = 30;
-static uint32_t actual_fps = 30;
-static uint32_t sys_fps = 60;
-static uint32_t cpu_usage = 0;
+// set by the game thread in pipelined mode
+static std::atomic<uint32_t> target_fps(30);
+static std::atomic<uint32_t> actual_fps(30);
+static std::atomic<uint32_t> sys_fps(60);
+static std::atomic<uint32_t> cpu_usage(0);
 
 void HAL_SetFrameRates(uint32_t target, uint32_t actual, uint32_t sys, uint32_t cpu) {
 	target_fps = target;
@@ -625,3 +1093,11 @@ void DEBUG_Trace(bool enable) {
 bool DEBUG_ReloadRequested() {
 	return reload_requested;
 }
+
+bool DEBUG_Turbo() {
+	return turbo_state;
+}
+
+void DEBUG_Turbo(bool enable) {
+	turbo_state = enable;
+}
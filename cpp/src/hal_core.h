@@ -18,9 +18,26 @@ void GFX_Init(int x, int y);
 void GFX_End();
 
 void GFX_CreateBackBuffer(int x, int y);
-void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h, const std::array<uint8_t, 256>& screen_palette);
+// dirty_rows, if given, has one entry per row of the buffer, only rows with non zero entries
+// have changed since the last copy. all rows are copied when it is null or the palette changed.
+void GFX_CopyBackBuffer(uint8_t* buffer,
+                        int buffer_w,
+                        int buffer_h,
+                        const std::array<uint8_t, 256>& screen_palette,
+                        const uint8_t* dirty_rows = nullptr);
 void GFX_SetBackBufferSize(int x, int y);
 
+// how GFX_CopyBackBuffer gets the core's 8 bit buffer into the texture that is presented.
+// RGB565 converts into a 16 bit texture, ARGB8888 converts into a 32 bit texture in the
+// renderer's native format, INDEX8 wraps the buffer in an 8 bit surface whose palette is the
+// screen palette and lets SDL convert it into a native 32 bit texture. the initial mode can be
+// set with the TAC08_PRESENT_MODE hint ("rgb565", "argb8888" or "index8").
+enum GFX_PresentMode { GFX_PRESENT_RGB565, GFX_PRESENT_ARGB8888, GFX_PRESENT_INDEX8 };
+void GFX_SetPresentMode(GFX_PresentMode mode);
+GFX_PresentMode GFX_GetPresentMode();
+
+// renders and presents the texture, does nothing unless the texture, zoom or window changed
+// since the last call.
 void GFX_Flip();
 
 void GFX_SelectPalette(const std::string& name);
@@ -47,6 +64,8 @@ void FILE_WriteClip(const std::string& data);
 std::string FILE_GetDefaultCartName();
 
 bool EVT_ProcessEvents();
+// waits up to us microseconds, returns early when an event arrives
+void EVT_WaitEvents(uint64_t us);
 uint8_t INP_GetInputState();
 void INP_SetSimState(uint8_t state);
 
@@ -57,6 +76,9 @@ uint64_t TIME_GetProfileTime();
 uint64_t TIME_GetElapsedProfileTime_us(uint64_t start);
 uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start);
 void TIME_Sleep(int ms);
+// monotonic high resolution clock used to schedule frames, in microseconds since GFX_Init
+uint64_t TIME_GetTime_us();
+void TIME_Sleep_us(uint64_t us);
 
 struct MouseState {
 	int x;
@@ -89,5 +111,9 @@ void PLATFORM_OpenURL(std::string url);
 bool DEBUG_Trace();
 void DEBUG_Trace(bool enable);
 bool DEBUG_ReloadRequested();
+// fast forward, the cart's update runs as fast as it can and only some frames are drawn.
+// toggled with F9.
+bool DEBUG_Turbo();
+void DEBUG_Turbo(bool enable);
 
 #endif /* GFX_CORE_H */
@@ -0,0 +1,93 @@
+#include "hal_framehash.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "hal_core.h"
+#include "utils.h"
+
+static FILE* hash_file = nullptr;
+static bool checking = false;
+static std::vector<uint64_t> golden;
+static std::string golden_name;
+static uint32_t frame = 0;
+static bool failed = false;
+
+void HASH_StartWriting(const std::string& filename) {
+	hash_file = fopen(filename.c_str(), "w");
+	if (!hash_file) {
+		throw gfx_exception("failed to create frame hash file: " + filename);
+	}
+	frame = 0;
+}
+
+void HASH_StartChecking(const std::string& filename) {
+	FILE* file = fopen(filename.c_str(), "r");
+	if (!file) {
+		throw gfx_exception("failed to open golden frame hashes: " + filename);
+	}
+	golden.clear();
+	uint32_t n;
+	uint64_t hash;
+	while (fscanf(file, "%" SCNu32 " %" SCNx64, &n, &hash) == 2) {
+		if (n != golden.size()) {
+			fclose(file);
+			throw gfx_exception("golden frame hashes out of order: " + filename);
+		}
+		golden.push_back(hash);
+	}
+	fclose(file);
+
+	golden_name = filename;
+	checking = true;
+	failed = false;
+	frame = 0;
+}
+
+void HASH_Frame(const uint8_t* buffer,
+                int buffer_w,
+                int buffer_h,
+                const std::array<uint8_t, 256>& screen_palette) {
+	if (!hash_file && !checking) {
+		return;
+	}
+
+	int32_t size[2] = {buffer_w, buffer_h};
+	uint64_t hash = utils::hash64(size, sizeof(size));
+	hash = utils::hash64(buffer, size_t(buffer_w) * buffer_h, hash);
+	hash = utils::hash64(screen_palette.data(), screen_palette.size(), hash);
+
+	if (hash_file) {
+		fprintf(hash_file, "%" PRIu32 " %016" PRIx64 "\n", frame, hash);
+	}
+	if (checking && !failed && frame < golden.size() && golden[frame] != hash) {
+		fprintf(stderr, "%s: frame %" PRIu32 " differs, hash %016" PRIx64 " expected %016" PRIx64 "\n",
+		        golden_name.c_str(), frame, hash, golden[frame]);
+		failed = true;
+	}
+	frame++;
+}
+
+bool HASH_Stop() {
+	if (hash_file) {
+		fclose(hash_file);
+		hash_file = nullptr;
+	}
+	if (checking) {
+		if (!failed && frame != golden.size()) {
+			fprintf(stderr, "%s: ran %" PRIu32 " frames, expected %d\n", golden_name.c_str(), frame,
+			        int(golden.size()));
+			failed = true;
+		} else if (!failed) {
+			fprintf(stderr, "%s: %" PRIu32 " frames match\n", golden_name.c_str(), frame);
+		}
+		checking = false;
+	}
+	return !failed;
+}
+
+bool HASH_Active() {
+	return hash_file || checking;
+}
@@ -0,0 +1,30 @@
+#ifndef HAL_FRAMEHASH_H
+#define HAL_FRAMEHASH_H
+
+#include <stdint.h>
+
+#include <array>
+#include <string>
+
+// per frame hashes of the core's screen, used to check that changes to the renderer are pixel
+// exact without storing whole images. each hash covers the backbuffer size, its pixels and the
+// screen palette they are displayed with. the hash files have one line per game frame:
+// "<frame> <hash as 16 hex digits>".
+
+// writes the hash of every frame to filename
+void HASH_StartWriting(const std::string& filename);
+// compares the hash of every frame against a golden list read from filename, the first frame
+// that differs is reported on stderr
+void HASH_StartChecking(const std::string& filename);
+
+void HASH_Frame(const uint8_t* buffer,
+                int buffer_w,
+                int buffer_h,
+                const std::array<uint8_t, 256>& screen_palette);
+
+// closes the files and reports a length mismatch with the golden list. returns false if the
+// frames did not match it.
+bool HASH_Stop();
+bool HASH_Active();
+
+#endif /* HAL_FRAMEHASH_H */
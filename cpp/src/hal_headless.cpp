@@ -0,0 +1,473 @@
+// headless implementation of hal_core.h. no window, no audio and no sdl, the screen is kept in
+// an in memory framebuffer and input comes from a script. used to run carts on machines without
+// a display and to benchmark the core without compositor or vsync noise.
+//
+// configured through environment variables:
+//   TAC08_DEFAULT_CART_NAME  cart loaded when none is given on the command line
+//   TAC08_HEADLESS_FRAMES    stop after this many game frames (default: run until ctrl-c)
+//   TAC08_HEADLESS_CLOCK     "virtual" (default) only advances the clock when the main loop
+//                            sleeps until the next frame, so frames run back to back.
+//                            "monotonic" uses the system clock
+//   TAC08_HEADLESS_INPUT     input script, one event per line:
+//                              <frame> btn <state>          dpad/button bits as returned by btn()
+//                              <frame> mouse <x> <y> <buttons>
+//                              <frame> key <text>           queue a key press for stat(31)
+//   TAC08_HEADLESS_DUMP      write the last presented frame to this file as a binary ppm
+//   TAC08_HEADLESS_SAVE_DIR  directory for cartdata and wrstr files (default: current dir)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "hal_core.h"
+#include "hal_palette.h"
+#include "hal_record.h"
+
+// palette colours as 0xrrggbb
+static std::array<uint32_t, 256> original_palette;
+static std::array<uint32_t, 256> palette;
+static std::string selectedPalette;
+
+static std::atomic<GFX_PresentMode> presentMode(GFX_PRESENT_RGB565);
+
+// the presented screen as 0xrrggbb pixels
+static std::vector<uint32_t> framebuffer;
+static int screenWidth = config::INIT_SCREEN_WIDTH;
+static int screenHeight = config::INIT_SCREEN_HEIGHT;
+static int displayWidth = 0;
+static int displayHeight = 0;
+
+static std::atomic<bool> debug_trace_state(false);
+static std::atomic<bool> turbo_state(false);
+
+static bool virtual_clock = true;
+// advanced by TIME_Sleep_us, atomic as the pipelined mode reads it from two threads
+static std::atomic<uint64_t> virtual_time_us(0);
+static uint64_t clock_start_us = 0;
+
+static int64_t max_frames = -1;
+static int64_t frame_count = 0;
+
+static std::string env(const char* name, const char* def = "") {
+	const char* val = getenv(name);
+	return val ? val : def;
+}
+
+static uint64_t monotonic_us() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct InputEvent {
+	int64_t frame;
+	enum Type { Btn, Mouse, Key } type;
+	int x = 0;
+	int y = 0;
+	int buttons = 0;
+	std::string key;
+};
+
+static std::deque<InputEvent> input_script;
+static uint8_t inputState = 0;
+static uint8_t simState = 0;
+static MouseState mouseState = {0, 0, 0, 0};
+static std::deque<std::string> keypresses;
+
+static void loadInputScript(const std::string& filename) {
+	std::ifstream file(filename);
+	if (!file) {
+		throw gfx_exception("failed to open input script: " + filename);
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream ss(line);
+		InputEvent ev;
+		std::string type;
+		if (!(ss >> ev.frame >> type)) {
+			continue;
+		}
+		if (type == "btn") {
+			ev.type = InputEvent::Btn;
+			ss >> ev.buttons;
+		} else if (type == "mouse") {
+			ev.type = InputEvent::Mouse;
+			ss >> ev.x >> ev.y >> ev.buttons;
+		} else if (type == "key") {
+			ev.type = InputEvent::Key;
+			ss >> ev.key;
+		} else {
+			continue;
+		}
+		input_script.push_back(ev);
+	}
+}
+
+// applies the scripted events up to and including the current frame
+static void applyInputScript() {
+	while (!input_script.empty() && input_script.front().frame <= frame_count) {
+		const InputEvent& ev = input_script.front();
+		switch (ev.type) {
+			case InputEvent::Btn:
+				inputState = uint8_t(ev.buttons);
+				break;
+			case InputEvent::Mouse:
+				mouseState.x = ev.x;
+				mouseState.y = ev.y;
+				mouseState.buttons = ev.buttons;
+				break;
+			case InputEvent::Key:
+				keypresses.push_back(ev.key);
+				break;
+		}
+		input_script.pop_front();
+	}
+}
+
+void GFX_Init(int x, int y) {
+	debug_trace_state = false;
+	displayWidth = x;
+	displayHeight = y;
+
+	virtual_clock = env("TAC08_HEADLESS_CLOCK", "virtual") != "monotonic";
+	virtual_time_us = 0;
+	clock_start_us = monotonic_us();
+
+	std::string frames = env("TAC08_HEADLESS_FRAMES");
+	max_frames = frames.empty() ? -1 : atoll(frames.c_str());
+	frame_count = 0;
+
+	std::string script = env("TAC08_HEADLESS_INPUT");
+	if (!script.empty()) {
+		loadInputScript(script);
+	}
+}
+
+static void writeFrame(const std::string& filename) {
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file) {
+		return;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", screenWidth, screenHeight);
+	for (int i = 0; i < screenWidth * screenHeight; i++) {
+		uint32_t p = framebuffer[i];
+		uint8_t rgb[3] = {uint8_t(p >> 16), uint8_t(p >> 8), uint8_t(p)};
+		fwrite(rgb, 1, 3, file);
+	}
+	fclose(file);
+}
+
+void GFX_End() {
+	std::string dump = env("TAC08_HEADLESS_DUMP");
+	if (!dump.empty() && !framebuffer.empty()) {
+		writeFrame(dump);
+	}
+}
+
+void checkmem() {
+}
+
+void GFX_ToggleFullScreen() {
+}
+
+void GFX_SetFullScreen(bool fullscreen) {
+}
+
+void GFX_CreateBackBuffer(int x, int y) {
+	GFX_SetBackBufferSize(x, y);
+	framebuffer.assign(config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT, 0);
+	GFX_SelectPalette("pico8");
+}
+
+void GFX_SetBackBufferSize(int x, int y) {
+	screenWidth = x;
+	screenHeight = y;
+}
+
+void GFX_SetPresentMode(GFX_PresentMode mode) {
+	presentMode = mode;
+}
+
+GFX_PresentMode GFX_GetPresentMode() {
+	return presentMode;
+}
+
+void GFX_SelectPalette(const std::string& name) {
+	auto& pal = GFX_GetPaletteInfo(name);
+	selectedPalette = name;
+
+	for (size_t i = 0; i < pal.size; i++) {
+		original_palette[i] = pal.pal[i] & 0xffffff;
+		palette[i] = original_palette[i];
+	}
+}
+
+void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
+	palette[to] = original_palette[from];
+}
+
+void GFX_RestorePaletteMapping() {
+	palette = original_palette;
+}
+
+void GFX_RestorePaletteMappingIndex(uint8_t i) {
+	palette[i] = original_palette[i];
+}
+
+void GFX_RestorePaletteRGB() {
+	GFX_SelectPalette(selectedPalette);
+}
+
+void GFX_RestorePaletteRGBIndex(uint8_t i) {
+	auto& pal = GFX_GetPaletteInfo(selectedPalette);
+	if (i < pal.size) {
+		original_palette[i] = pal.pal[i] & 0xffffff;
+		palette[i] = original_palette[i];
+	}
+}
+
+void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
+	palette[i] = (uint32_t(r) << 16) | (uint32_t(g) << 8) | b;
+	original_palette[i] = palette[i];
+}
+
+void GFX_CopyBackBuffer(uint8_t* buffer,
+                        int buffer_w,
+                        int buffer_h,
+                        const std::array<uint8_t, 256>& screen_palette,
+                        const uint8_t* dirty_rows) {
+	std::array<uint32_t, 256> lut;
+	for (int i = 0; i < 256; i++) {
+		lut[i] = palette[screen_palette[i]];
+	}
+
+	// the framebuffer is packed to the buffer width, every row is converted as a size or palette
+	// change affects all of them.
+	uint32_t* pixels = framebuffer.data();
+	for (int i = 0; i < buffer_w * buffer_h; i++) {
+		pixels[i] = lut[buffer[i]];
+	}
+}
+
+void GFX_Flip() {
+}
+
+void GFX_ShowHWMouse(bool show) {
+}
+
+void GFX_GetDisplayArea(int* w, int* h) {
+	*w = displayWidth;
+	*h = displayHeight;
+}
+
+void GFX_SetZoom(int x, int y, double factor, double rot) {
+}
+
+std::string FILE_LoadFile(std::string name) {
+	std::ifstream file(name, std::ios::binary);
+	if (!file) {
+		return "";
+	}
+	std::ostringstream data;
+	data << file.rdbuf();
+	return data.str();
+}
+
+static std::string saveDir() {
+	std::string dir = env("TAC08_HEADLESS_SAVE_DIR", ".");
+	if (!dir.empty() && dir.back() != '/') {
+		dir += '/';
+	}
+	return dir;
+}
+
+std::string FILE_LoadGameState(std::string name) {
+	return FILE_LoadFile(saveDir() + name);
+}
+
+void FILE_SaveGameState(std::string name, std::string data) {
+	std::ofstream file(saveDir() + name, std::ios::binary);
+	file << data;
+}
+
+static std::string clipboard;
+
+std::string FILE_ReadClip() {
+	return clipboard;
+}
+
+void FILE_WriteClip(const std::string& data) {
+	clipboard = data;
+}
+
+std::string FILE_GetDefaultCartName() {
+	return env("TAC08_DEFAULT_CART_NAME", "cart.p8");
+}
+
+bool EVT_ProcessEvents() {
+	return max_frames < 0 || frame_count < max_frames;
+}
+
+void EVT_WaitEvents(uint64_t us) {
+	TIME_Sleep_us(us);
+}
+
+uint8_t INP_GetInputState() {
+	return inputState | simState;
+}
+
+void INP_SetSimState(uint8_t state) {
+	simState = state;
+}
+
+MouseState INP_GetMouseState() {
+	if (REC_Replaying()) {
+		return REC_ReplayedFrame().mouse;
+	}
+	MouseState ms = mouseState;
+	mouseState.wheel = 0;
+	return ms;
+}
+
+bool INP_TouchAvailable() {
+	return false;
+}
+
+uint8_t INP_GetTouchMask() {
+	if (REC_Replaying()) {
+		return REC_ReplayedFrame().touch_mask;
+	}
+	return 0;
+}
+
+TouchInfo INP_GetTouchInfo(int idx) {
+	if (REC_Replaying()) {
+		const FrameInput& replayed = REC_ReplayedFrame();
+		return idx >= 0 && idx < (int)replayed.touches.size() ? replayed.touches[idx] : TouchInfo{};
+	}
+	return TouchInfo{};
+}
+
+std::string INP_GetKeyPress() {
+	if (REC_Replaying()) {
+		return REC_ReplayedKeyPress();
+	}
+	if (keypresses.size() == 0) {
+		return "";
+	}
+	auto k = keypresses[0];
+	keypresses.pop_front();
+	return k;
+}
+
+uint32_t TIME_GetTime_ms() {
+	return uint32_t(TIME_GetTime_us() / 1000);
+}
+
+uint32_t TIME_GetElapsedTime_ms(uint32_t start) {
+	return TIME_GetTime_ms() - start;
+}
+
+// profile times always use the real clock so the core can be benchmarked
+uint64_t TIME_GetProfileTime() {
+	return monotonic_us();
+}
+
+uint64_t TIME_GetElapsedProfileTime_us(uint64_t start) {
+	return monotonic_us() - start;
+}
+
+uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start) {
+	return (monotonic_us() - start) / 1000;
+}
+
+void TIME_Sleep(int ms) {
+	TIME_Sleep_us(uint64_t(ms) * 1000);
+}
+
+uint64_t TIME_GetTime_us() {
+	if (virtual_clock) {
+		return virtual_time_us;
+	}
+	return monotonic_us() - clock_start_us;
+}
+
+void TIME_Sleep_us(uint64_t us) {
+	if (virtual_clock) {
+		// nothing to wait for, time just moves on
+		virtual_time_us += us;
+	} else {
+		timespec ts = {time_t(us / 1000000), long(us % 1000000) * 1000};
+		nanosleep(&ts, nullptr);
+	}
+}
+
+void HAL_StartFrame() {
+	simState = 0;
+	applyInputScript();
+}
+
+void HAL_EndFrame() {
+	frame_count++;
+}
+
+// set by the game thread in pipelined mode
+static std::atomic<uint32_t> target_fps(30);
+static std::atomic<uint32_t> actual_fps(30);
+static std::atomic<uint32_t> sys_fps(60);
+static std::atomic<uint32_t> cpu_usage(0);
+
+void HAL_SetFrameRates(uint32_t target, uint32_t actual, uint32_t sys, uint32_t cpu) {
+	target_fps = target;
+	actual_fps = actual;
+	sys_fps = sys;
+	cpu_usage = cpu;
+}
+
+// 't' = target, 'a' = actual, 's' = sys
+uint32_t HAL_GetFrameRate(char fps_type) {
+	switch (fps_type) {
+		case 't':
+			return target_fps;
+		case 'a':
+			return actual_fps;
+		case 's':
+			return sys_fps;
+		case 'c':
+			return cpu_usage;
+	}
+	return 0;
+}
+
+void PLATFORM_OpenURL(std::string url) {
+}
+
+bool DEBUG_Trace() {
+	return debug_trace_state;
+}
+
+void DEBUG_Trace(bool enable) {
+	debug_trace_state = enable;
+}
+
+bool DEBUG_ReloadRequested() {
+	return false;
+}
+
+bool DEBUG_Turbo() {
+	return turbo_state;
+}
+
+void DEBUG_Turbo(bool enable) {
+	turbo_state = enable;
+}
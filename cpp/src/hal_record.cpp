@@ -0,0 +1,304 @@
+#include "hal_record.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <deque>
+
+// log format: an 8 byte header, the rnd() seed as 4 bytes little endian, then one record per
+// game frame. each record starts with a byte of flags saying which values changed since the
+// previous frame, followed by only those values. numbers are stored as LEB128 varints, signed
+// ones zigzag encoded, so an idle frame usually takes 2-3 bytes.
+static const char log_header[8] = {'T', 'A', 'C', '0', '8', 'I', 'N', 2};
+
+enum {
+	REC_BUTTONS = 0x01,
+	REC_TIME = 0x02,
+	REC_DISPLAY = 0x04,
+	REC_MOUSE = 0x08,
+	REC_TOUCH = 0x10,
+	REC_KEYS = 0x20,
+};
+
+static FILE* record_file = nullptr;
+static std::string replay_data;
+static size_t replay_pos = 0;
+static bool replaying = false;
+// the previous frame, values are stored relative to it
+static FrameInput last_frame;
+// the frame being replayed and the key presses it has not handed out yet
+static FrameInput replayed_frame;
+static std::deque<std::string> replayed_keys;
+
+static void write_varint(std::string& out, uint64_t v) {
+	while (v >= 0x80) {
+		out += char((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out += char(v);
+}
+
+static void write_signed(std::string& out, int64_t v) {
+	write_varint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+static uint64_t read_varint() {
+	uint64_t v = 0;
+	int shift = 0;
+	while (replay_pos < replay_data.size()) {
+		uint8_t b = replay_data[replay_pos++];
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+		shift += 7;
+		if (shift >= 64) {
+			// too long for a value written by record_frame, the log is corrupt so end it here
+			replay_pos = replay_data.size();
+			return 0;
+		}
+	}
+	return v;
+}
+
+static int64_t read_signed() {
+	uint64_t v = read_varint();
+	return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+static uint8_t read_byte() {
+	return replay_pos < replay_data.size() ? uint8_t(replay_data[replay_pos++]) : 0;
+}
+
+static bool same_touches(const FrameInput& a, const FrameInput& b) {
+	if (a.touch_mask != b.touch_mask) {
+		return false;
+	}
+	for (size_t n = 0; n < a.touches.size(); n++) {
+		if ((a.touch_mask & (1 << n)) &&
+		    (a.touches[n].x != b.touches[n].x || a.touches[n].y != b.touches[n].y ||
+		     a.touches[n].state != b.touches[n].state)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void record_frame(const FrameInput& in) {
+	std::string out;
+	uint8_t flags = 0;
+	if (in.buttons != last_frame.buttons) {
+		flags |= REC_BUTTONS;
+	}
+	if (in.time_ms != last_frame.time_ms) {
+		flags |= REC_TIME;
+	}
+	if (in.display_w != last_frame.display_w || in.display_h != last_frame.display_h) {
+		flags |= REC_DISPLAY;
+	}
+	if (in.mouse.x != last_frame.mouse.x || in.mouse.y != last_frame.mouse.y ||
+	    in.mouse.buttons != last_frame.mouse.buttons || in.mouse.wheel != last_frame.mouse.wheel) {
+		flags |= REC_MOUSE;
+	}
+	if (!same_touches(in, last_frame)) {
+		flags |= REC_TOUCH;
+	}
+	if (!in.keys.empty()) {
+		flags |= REC_KEYS;
+	}
+
+	out += char(flags);
+	if (flags & REC_BUTTONS) {
+		out += char(in.buttons);
+	}
+	if (flags & REC_TIME) {
+		write_signed(out, int64_t(in.time_ms) - int64_t(last_frame.time_ms));
+	}
+	if (flags & REC_DISPLAY) {
+		write_varint(out, in.display_w);
+		write_varint(out, in.display_h);
+	}
+	if (flags & REC_MOUSE) {
+		write_signed(out, in.mouse.x);
+		write_signed(out, in.mouse.y);
+		write_varint(out, in.mouse.buttons);
+		write_signed(out, in.mouse.wheel);
+	}
+	if (flags & REC_TOUCH) {
+		out += char(in.touch_mask);
+		for (size_t n = 0; n < in.touches.size(); n++) {
+			if (in.touch_mask & (1 << n)) {
+				write_signed(out, in.touches[n].x);
+				write_signed(out, in.touches[n].y);
+				out += char(in.touches[n].state);
+			}
+		}
+	}
+	if (flags & REC_KEYS) {
+		write_varint(out, in.keys.size());
+		for (const std::string& k : in.keys) {
+			write_varint(out, k.size());
+			out += k;
+		}
+	}
+
+	fwrite(out.data(), 1, out.size(), record_file);
+	last_frame = in;
+	last_frame.keys.clear();
+}
+
+static FrameInput replay_frame() {
+	FrameInput in = last_frame;
+	uint8_t flags = read_byte();
+	if (flags & REC_BUTTONS) {
+		in.buttons = read_byte();
+	}
+	if (flags & REC_TIME) {
+		in.time_ms = uint32_t(int64_t(in.time_ms) + read_signed());
+	}
+	if (flags & REC_DISPLAY) {
+		in.display_w = int(read_varint());
+		in.display_h = int(read_varint());
+	}
+	if (flags & REC_MOUSE) {
+		in.mouse.x = int(read_signed());
+		in.mouse.y = int(read_signed());
+		in.mouse.buttons = int(read_varint());
+		in.mouse.wheel = int(read_signed());
+	}
+	if (flags & REC_TOUCH) {
+		in.touch_mask = read_byte();
+		for (size_t n = 0; n < in.touches.size(); n++) {
+			if (in.touch_mask & (1 << n)) {
+				in.touches[n].x = int(read_signed());
+				in.touches[n].y = int(read_signed());
+				in.touches[n].state = read_byte();
+			}
+		}
+	}
+	if (flags & REC_KEYS) {
+		size_t count = size_t(read_varint());
+		for (size_t i = 0; i < count; i++) {
+			size_t len = std::min(size_t(read_varint()), replay_data.size() - replay_pos);
+			in.keys.push_back(replay_data.substr(replay_pos, len));
+			replay_pos += len;
+		}
+	}
+	last_frame = in;
+	last_frame.keys.clear();
+	return in;
+}
+
+FrameInput REC_SampleInput() {
+	FrameInput in;
+	in.buttons = INP_GetInputState();
+	GFX_GetDisplayArea(&in.display_w, &in.display_h);
+
+	if (record_file) {
+		in.mouse = INP_GetMouseState();
+		in.touch_mask = INP_GetTouchMask();
+		for (size_t n = 0; n < in.touches.size(); n++) {
+			if (in.touch_mask & (1 << n)) {
+				in.touches[n] = INP_GetTouchInfo(int(n));
+			}
+		}
+		for (std::string k = INP_GetKeyPress(); !k.empty(); k = INP_GetKeyPress()) {
+			in.keys.push_back(k);
+		}
+	}
+	return in;
+}
+
+FrameInput REC_NextFrame(const FrameInput& live) {
+	if (replaying) {
+		if (replay_pos < replay_data.size()) {
+			replayed_frame = replay_frame();
+			replayed_keys.insert(replayed_keys.end(), replayed_frame.keys.begin(),
+			                     replayed_frame.keys.end());
+			return replayed_frame;
+		}
+		// end of the log, hand control back to the player
+		REC_Stop();
+	}
+	if (record_file) {
+		record_frame(live);
+	}
+	return live;
+}
+
+void REC_StartRecording(const std::string& filename, int32_t seed) {
+	REC_Stop();
+	record_file = fopen(filename.c_str(), "wb");
+	if (!record_file) {
+		throw gfx_exception("failed to create input log: " + filename);
+	}
+	fwrite(log_header, 1, sizeof(log_header), record_file);
+	uint8_t seed_bytes[4];
+	for (int i = 0; i < 4; i++) {
+		seed_bytes[i] = uint8_t(uint32_t(seed) >> (i * 8));
+	}
+	fwrite(seed_bytes, 1, sizeof(seed_bytes), record_file);
+	last_frame = FrameInput();
+}
+
+int32_t REC_StartReplay(const std::string& filename) {
+	REC_Stop();
+
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (!file) {
+		throw gfx_exception("failed to open input log: " + filename);
+	}
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		replay_data.append(buffer, n);
+	}
+	fclose(file);
+
+	if (replay_data.size() < sizeof(log_header) + 4 ||
+	    replay_data.compare(0, sizeof(log_header), log_header, sizeof(log_header)) != 0) {
+		replay_data.clear();
+		throw gfx_exception("not an input log: " + filename);
+	}
+	replay_pos = sizeof(log_header);
+	uint32_t seed = 0;
+	for (int i = 0; i < 4; i++) {
+		seed |= uint32_t(read_byte()) << (i * 8);
+	}
+	replaying = true;
+	last_frame = FrameInput();
+	replayed_frame = FrameInput();
+	return int32_t(seed);
+}
+
+void REC_Stop() {
+	if (record_file) {
+		fclose(record_file);
+		record_file = nullptr;
+	}
+	replaying = false;
+	replayed_keys.clear();
+	replay_data.clear();
+	replay_pos = 0;
+}
+
+bool REC_Recording() {
+	return record_file != nullptr;
+}
+
+bool REC_Replaying() {
+	return replaying;
+}
+
+const FrameInput& REC_ReplayedFrame() {
+	return replayed_frame;
+}
+
+std::string REC_ReplayedKeyPress() {
+	if (replayed_keys.empty()) {
+		return "";
+	}
+	std::string k = replayed_keys.front();
+	replayed_keys.pop_front();
+	return k;
+}
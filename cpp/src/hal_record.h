@@ -0,0 +1,48 @@
+#ifndef HAL_RECORD_H
+#define HAL_RECORD_H
+
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "hal_core.h"
+
+// everything a game frame takes from the outside world. recorded once per frame to a compact
+// binary log and fed back in from it on replay, so a session plays back exactly.
+struct FrameInput {
+	uint32_t time_ms = 0;
+	uint8_t buttons = 0;
+	int display_w = 0;
+	int display_h = 0;
+	// mouse, touch and keys are only sampled while recording or replaying
+	MouseState mouse = {0, 0, 0, 0};
+	uint8_t touch_mask = 0;
+	std::array<TouchInfo, 8> touches;
+	std::vector<std::string> keys;
+};
+
+// samples the live input from the hal. time_ms is not set, the caller sets it when the frame
+// runs.
+FrameInput REC_SampleInput();
+
+// returns the input for the next game frame. while replaying this is the next recorded frame
+// (live is used once the log runs out), while recording live is appended to the log.
+FrameInput REC_NextFrame(const FrameInput& live);
+
+// seed is the rnd() seed the cart runs with, it is stored in the log. REC_StartReplay returns
+// it, seed rnd() with it before the cart is loaded.
+void REC_StartRecording(const std::string& filename, int32_t seed);
+int32_t REC_StartReplay(const std::string& filename);
+void REC_Stop();
+bool REC_Recording();
+bool REC_Replaying();
+
+// while replaying, INP_GetMouseState, INP_GetTouchMask, INP_GetTouchInfo and INP_GetKeyPress
+// return the mouse, touch and keys of the frame being replayed from these, in place of the
+// live input.
+const FrameInput& REC_ReplayedFrame();
+std::string REC_ReplayedKeyPress();
+
+#endif /* HAL_RECORD_H */
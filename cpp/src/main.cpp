@@ -1,7 +1,23 @@
+#ifndef TAC08_HEADLESS
 #include <SDL2/SDL.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "config.h"
 #include "hal_core.h"
+#include "hal_framehash.h"
+#include "hal_record.h"
 #include "pico_cart.h"
 #include "pico_core.h"
 #include "pico_data.h"
@@ -18,25 +34,69 @@ void load_cart(std::string filename) {
 	pico_api::load(data);
 }
 
-int safe_main(int argc, char** argv) {
-	//	GFX_Init(config::INIT_SCREEN_WIDTH * 4, config::INIT_SCREEN_HEIGHT * 4);
-	GFX_Init(512 * 3, 256 * 3);
-	GFX_CreateBackBuffer(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
-	pico_control::init();
-	pico_data::load_font_data();
+// fixed timestep frame scheduler on the high resolution clock. frames are due every 1/fps
+// seconds, when the loop falls behind up to max_skip frames are run without drawing to catch up
+// and any further backlog is dropped.
+struct FrameScheduler {
+	uint64_t step_us = 1000000 / 30;
+	uint64_t deadline = 0;
+	int max_skip = 2;
+	// frame deadlines that passed without a frame being drawn
+	uint32_t missed = 0;
 
-	if (argc == 1) {
-		load_cart(FILE_GetDefaultCartName());
-	} else {
-		if (argc > 1) {
-			load_cart(argv[1]);
-		} else {
-			return 1;
+	void setRate(uint32_t fps, uint64_t now) {
+		uint64_t step = 1000000 / fps;
+		if (step != step_us) {
+			step_us = step;
+			deadline = now;
+		}
+	}
+
+	// returns the number of frames to run at now, 0 if the next frame is not due yet. only the
+	// last of these frames should be drawn.
+	int due(uint64_t now) {
+		if (now < deadline) {
+			return 0;
+		}
+		uint64_t behind = (now - deadline) / step_us + 1;
+		missed += uint32_t(behind - 1);
+		if (behind > uint64_t(max_skip) + 1) {
+			// too far behind to catch up, start again from now
+			deadline = now + step_us;
+			return max_skip + 1;
 		}
+		deadline += behind * step_us;
+		return int(behind);
+	}
+
+	uint64_t timeToDeadline(uint64_t now) const {
+		return now < deadline ? deadline - now : 0;
 	}
+};
 
-	uint32_t target_ticks = 20;
-	uint32_t ticks = 0;
+// the cart side of the main loop, the cart's frames are run when the scheduler says they are due
+struct GameLoop {
+	FrameScheduler scheduler;
+
+	// in deterministic mode the cart sees a virtual clock that advances by exactly one frame
+	// per game frame, frames run back to back without waiting for the scheduler or skipping
+	// draws, and the frame rate and cpu stats are reported as fixed values. the clock counts
+	// 1/60ths of a second so 30 and 60 fps steps are both exact.
+	bool deterministic = false;
+	uint64_t virtual_ticks = 0;
+
+	// in turbo mode one frame is run per iteration without waiting for the scheduler and only
+	// every turbo_draw_every'th frame is drawn and presented, never if it is 0. the cart's clock
+	// advances by one frame per frame like the virtual clock and carries on from where it got
+	// to when turbo mode ends.
+	bool turbo = false;
+	int turbo_draw_every = 16;
+	uint32_t turbo_frames = 0;
+	uint64_t turbo_start_ticks = 0;
+	uint32_t turbo_start_ms = 0;
+	// wall clock time not seen by the cart, the time it skipped over in turbo mode
+	uint32_t time_offset_ms = 0;
+	uint32_t last_time_ms = 0;
 	uint32_t target_fps = 30;
 	uint32_t actual_fps = 30;
 	uint32_t sys_fps = 60;
@@ -54,87 +114,149 @@ int safe_main(int argc, char** argv) {
 	bool restarted = true;
 	bool script_error = false;
 
-	while (EVT_ProcessEvents()) {
-		using namespace pico_api;
-
+	void startIteration() {
 		if (restarted == true) {
 			restarted = false;
 			script_error = false;
 			init = false;
 		}
 
+		setTurbo(DEBUG_Turbo());
+
 		target_fps = pico_script::symbolExist("_update60") ? 60 : 30;
-		HAL_SetFrameRates(target_fps, actual_fps, sys_fps, cpu_usage);
-		pico_api::update_fps(target_fps, actual_fps, sys_fps, cpu_usage);
+		if (deterministic) {
+			HAL_SetFrameRates(target_fps, target_fps, target_fps, 0);
+			pico_api::update_fps(target_fps, target_fps, target_fps, 0);
+		} else {
+			HAL_SetFrameRates(target_fps, actual_fps, sys_fps, cpu_usage);
+			pico_api::update_fps(target_fps, actual_fps, sys_fps, cpu_usage);
+		}
 
-		int x, y;
-		GFX_GetDisplayArea(&x, &y);
-		pico_api::update_display_area(x, y);
+		scheduler.setRate(target_fps, TIME_GetTime_us());
+	}
 
-		pico_api::set_time(TIME_GetTime_ms());
+	void setTurbo(bool enable) {
+		if (enable == turbo) {
+			return;
+		}
+		turbo = enable;
+		if (turbo) {
+			turbo_frames = 0;
+			turbo_start_ticks = virtual_ticks;
+			turbo_start_ms = last_time_ms;
+		} else {
+			time_offset_ms = TIME_GetTime_ms() - last_time_ms;
+			scheduler.deadline = TIME_GetTime_us();
+		}
+	}
 
-		if ((TIME_GetTime_ms() - ticks) > target_ticks) {
-			HAL_StartFrame();
-			pico_control::frame_start();
+	// the number of frames to run now
+	int dueFrames() {
+		return (deterministic || turbo) ? 1 : scheduler.due(TIME_GetTime_us());
+	}
 
-			if (!script_error) {
-				try {
-					if (!init) {
-						pico_script::run("_init", true, restarted);
-						init = true;
-					}
+	// whether to draw a frame, last is true for the last of the frames that are due
+	bool drawFrame(bool last) {
+		if (!turbo) {
+			return last;
+		}
+		turbo_frames++;
+		return turbo_draw_every > 0 && turbo_frames % turbo_draw_every == 0;
+	}
 
-					pico_script::run("_pre_update", true, restarted);
-					pico_control::set_input_state(INP_GetInputState());
-
-					if (pico_control::is_pause_menu()) {
-						if (pico_script::do_menu()) {
-							pico_control::end_pause_menu();
-						}
-					} else {
-						uint64_t updateTimeStart = TIME_GetProfileTime();
-						if (!pico_script::run("_update", true, restarted)) {
-							if (pico_script::run("_update60", true, restarted)) {
-								target_ticks = 1;
-							}
-						}
-						updateTime += TIME_GetElapsedProfileTime_us(updateTimeStart);
+	// how long to wait for the next frame when none are due
+	uint64_t timeToNextFrame() const {
+		return turbo ? 0 : scheduler.timeToDeadline(TIME_GetTime_us());
+	}
 
+	// the time the cart sees for the next frame
+	uint32_t frameTime() {
+		if (deterministic) {
+			last_time_ms = uint32_t(virtual_ticks * 1000 / 60);
+		} else if (turbo) {
+			last_time_ms = turbo_start_ms + uint32_t((virtual_ticks - turbo_start_ticks) * 1000 / 60);
+		} else {
+			last_time_ms = TIME_GetTime_ms() - time_offset_ms;
+		}
+		return last_time_ms;
+	}
+
+	// runs the cart's update and draw, the result is left in the core's backbuffer. draw is
+	// false for frames skipped to catch up.
+	void runFrame(const FrameInput& input, bool draw) {
+		pico_api::update_display_area(input.display_w, input.display_h);
+		pico_api::set_time(input.time_ms);
+
+		pico_control::frame_start();
+
+		if (!script_error) {
+			try {
+				if (!init) {
+					pico_script::run("_init", true, restarted);
+					init = true;
+				}
+
+				pico_script::run("_pre_update", true, restarted);
+				pico_control::set_input_state(input.buttons);
+
+				if (pico_control::is_pause_menu()) {
+					if (pico_script::do_menu()) {
+						pico_control::end_pause_menu();
+					}
+				} else {
+					uint64_t updateTimeStart = TIME_GetProfileTime();
+					if (!pico_script::run("_update", true, restarted)) {
+						pico_script::run("_update60", true, restarted);
+					}
+					updateTime += TIME_GetElapsedProfileTime_us(updateTimeStart);
+
+					if (draw) {
 						uint64_t drawTimeStart = TIME_GetProfileTime();
 						pico_script::run("_draw", true, restarted);
+						pico_control::flush_draw_commands();
 						drawTime += TIME_GetElapsedProfileTime_us(drawTimeStart);
 					}
-				} catch (pico_script::error& e) {
-					pico_control::displayerror(e.what());
-					script_error = true;
 				}
+			} catch (pico_script::error& e) {
+				pico_control::displayerror(e.what());
+				script_error = true;
 			}
+		}
+
+		// call flip() even though this does not do anything, some carts implement their
+		// own version to make end of frame.
+		pico_script::run("flip", true, restarted);
+	}
 
-			// call flip() even though this does not do anything, some carts implement their
-			// own version to make end of frame.
-			pico_script::run("flip", true, restarted);
+	void endFrame() {
+		gameFrameCount++;
+		virtual_ticks += 60 / target_fps;
 
+		if (HASH_Active()) {
 			int buffer_w;
 			int buffer_h;
 			pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
-			uint64_t copyBBStart = TIME_GetProfileTime();
-			GFX_SetBackBufferSize(buffer_w, buffer_h);
-			GFX_CopyBackBuffer(buffer, buffer_w, buffer_h, pico_api::get_screen_palette());
-			copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
+			HASH_Frame(buffer, buffer_w, buffer_h, pico_api::get_screen_palette());
+		}
 
-			ticks = TIME_GetTime_ms();
-			gameFrameCount++;
+		pico_control::frame_end();
+	}
 
-			pico_control::frame_end();
-			HAL_EndFrame();
-		}
+	// called once per iteration that ran frames
+	void endIteration() {
 		systemFrameCount++;
-		GFX_Flip();
 
 		if (TIME_GetElapsedTime_ms(frameTimer) >= 1000) {
 			updateTime /= gameFrameCount;
 			drawTime /= gameFrameCount;
 			copyBBTime /= gameFrameCount;
+			if (DEBUG_Trace()) {
+				static const char* present_modes[] = {"rgb565", "argb8888", "index8"};
+				printf("present (%s): %d us/frame, update: %d us, draw: %d us, missed: %d\n",
+				       present_modes[GFX_GetPresentMode()], int(copyBBTime), int(updateTime),
+				       int(drawTime), int(scheduler.missed));
+			}
+			scheduler.missed = 0;
 			actual_fps = gameFrameCount;
 			sys_fps = systemFrameCount;
 			cpu_usage = ((updateTime + drawTime) * 100) / (target_fps == 60 ? 16666 : 33333);
@@ -146,21 +268,336 @@ int safe_main(int argc, char** argv) {
 			frameTimer = TIME_GetTime_ms();
 		}
 	}
+};
+
+// runs the frames that are due, drawn is set if one of them was drawn. returns false if none
+// were due.
+static bool run_due_frames(GameLoop& loop, bool& drawn) {
+	int frames = loop.dueFrames();
+	drawn = false;
+	for (int i = 0; i < frames; i++) {
+		HAL_StartFrame();
+		FrameInput live = REC_SampleInput();
+		live.time_ms = loop.frameTime();
+		bool draw = loop.drawFrame(i == frames - 1);
+		loop.runFrame(REC_NextFrame(live), draw);
+		loop.endFrame();
+		drawn = drawn || draw;
+		if (i < frames - 1) {
+			HAL_EndFrame();
+		}
+	}
+	return frames > 0;
+}
+
+static void run_single_threaded(GameLoop& loop) {
+	while (EVT_ProcessEvents()) {
+		loop.startIteration();
+
+		bool drawn;
+		if (!run_due_frames(loop, drawn)) {
+			// nothing to do until the next frame is due, unless the window needs redrawing or
+			// an event arrives
+			GFX_Flip();
+			EVT_WaitEvents(loop.timeToNextFrame());
+			continue;
+		}
+
+		if (drawn) {
+			int buffer_w;
+			int buffer_h;
+			pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
+			uint64_t copyBBStart = TIME_GetProfileTime();
+			GFX_SetBackBufferSize(buffer_w, buffer_h);
+			GFX_CopyBackBuffer(buffer, buffer_w, buffer_h, pico_api::get_screen_palette(),
+			                   pico_control::get_dirty_rows());
+			pico_control::clear_dirty_rows();
+			loop.copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
+		}
+
+		HAL_EndFrame();
+		GFX_Flip();
+
+		loop.endIteration();
+	}
+}
+
+// a finished frame handed from the game thread to the present thread, with the screen palette
+// it was drawn with and the rows that changed since the previous frame handed over.
+struct FrameSlot {
+	std::vector<uint8_t> pixels;
+	std::vector<uint8_t> dirty_rows;
+	std::array<uint8_t, 256> screen_palette;
+	int w = 0;
+	int h = 0;
+};
+
+// state shared by the game and present threads, guarded by lock
+struct Pipeline {
+	std::mutex lock;
+	std::condition_variable frame_ready;
+
+	// triple buffered frames: the game thread fills write_slot, the newest finished frame is
+	// ready_slot and the present thread converts present_slot. -1 when there is none.
+	FrameSlot slots[3];
+	int write_slot = 0;
+	int ready_slot = -1;
+	int present_slot = -1;
+
+	// the latest input sampled by the present thread, key presses collect until a frame takes
+	// them
+	FrameInput input;
+
+	bool stop = false;
+	std::exception_ptr error;
+};
+
+// copies the core's backbuffer into write_slot and makes it the ready frame
+static void publish_frame(Pipeline& p) {
+	int buffer_w;
+	int buffer_h;
+	pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
+	const uint8_t* dirty_rows = pico_control::get_dirty_rows();
+
+	// write_slot is only changed by this thread and never presented, no lock needed to fill it
+	FrameSlot& slot = p.slots[p.write_slot];
+	slot.pixels.assign(buffer, buffer + buffer_w * buffer_h);
+	slot.dirty_rows.assign(dirty_rows, dirty_rows + buffer_h);
+	slot.screen_palette = pico_api::get_screen_palette();
+	slot.w = buffer_w;
+	slot.h = buffer_h;
+	pico_control::clear_dirty_rows();
+
+	{
+		std::lock_guard<std::mutex> guard(p.lock);
+		int written = p.write_slot;
+		if (p.ready_slot >= 0) {
+			// the previous frame was never presented, its changes have to go out with this one
+			FrameSlot& skipped = p.slots[p.ready_slot];
+			for (int y = 0; y < std::min(skipped.h, slot.h); y++) {
+				slot.dirty_rows[y] |= skipped.dirty_rows[y];
+			}
+			p.write_slot = p.ready_slot;
+		} else {
+			for (int i = 0; i < 3; i++) {
+				if (i != written && i != p.present_slot) {
+					p.write_slot = i;
+					break;
+				}
+			}
+		}
+		p.ready_slot = written;
+	}
+	p.frame_ready.notify_one();
+}
+
+// runs the cart on the scheduler's deadlines, independent of the display refresh
+static void game_thread(GameLoop& loop, Pipeline& p) {
+	try {
+		while (true) {
+			{
+				std::lock_guard<std::mutex> guard(p.lock);
+				if (p.stop) {
+					break;
+				}
+			}
+
+			loop.startIteration();
+
+			int frames = loop.dueFrames();
+			if (frames == 0) {
+				TIME_Sleep_us(loop.timeToNextFrame());
+				continue;
+			}
+			bool drawn = false;
+			for (int i = 0; i < frames; i++) {
+				FrameInput live;
+				{
+					std::lock_guard<std::mutex> guard(p.lock);
+					live = p.input;
+					p.input.keys.clear();
+				}
+				live.time_ms = loop.frameTime();
+				bool draw = loop.drawFrame(i == frames - 1);
+				loop.runFrame(REC_NextFrame(live), draw);
+				loop.endFrame();
+				drawn = drawn || draw;
+			}
+
+			if (drawn) {
+				uint64_t copyBBStart = TIME_GetProfileTime();
+				publish_frame(p);
+				loop.copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
+			}
+
+			loop.endIteration();
+		}
+	} catch (...) {
+		std::lock_guard<std::mutex> guard(p.lock);
+		p.error = std::current_exception();
+		p.stop = true;
+	}
+}
+
+// the calling thread owns the window. it handles the events and converts and presents the
+// frames handed over by the game thread, so the texture upload and the vsync wait overlap with
+// the cart's update and draw. the cart and the core are only used from the game thread.
+static void run_pipelined(GameLoop& loop) {
+	Pipeline p;
+	p.input = REC_SampleInput();
+	std::thread game(game_thread, std::ref(loop), std::ref(p));
+
+	while (EVT_ProcessEvents()) {
+		HAL_StartFrame();
+		FrameInput live = REC_SampleInput();
+
+		int slot;
+		{
+			std::unique_lock<std::mutex> guard(p.lock);
+			live.keys.insert(live.keys.begin(), p.input.keys.begin(), p.input.keys.end());
+			p.input = live;
+			// wake up now and then to keep handling events while the cart is busy
+			p.frame_ready.wait_for(guard, std::chrono::milliseconds(10),
+			                       [&] { return p.stop || p.ready_slot >= 0; });
+			if (p.stop) {
+				break;
+			}
+			slot = p.ready_slot;
+			p.present_slot = slot;
+			p.ready_slot = -1;
+		}
+
+		if (slot < 0) {
+			// no new frame, only redraws if the window changed
+			GFX_Flip();
+			continue;
+		}
+
+		FrameSlot& f = p.slots[slot];
+		GFX_SetBackBufferSize(f.w, f.h);
+		GFX_CopyBackBuffer(f.pixels.data(), f.w, f.h, f.screen_palette, f.dirty_rows.data());
+		HAL_EndFrame();
+
+		{
+			std::lock_guard<std::mutex> guard(p.lock);
+			p.present_slot = -1;
+		}
+
+		GFX_Flip();
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(p.lock);
+		p.stop = true;
+	}
+	game.join();
+
+	if (p.error) {
+		std::rethrow_exception(p.error);
+	}
+}
+
+int safe_main(int argc, char** argv) {
+	//	GFX_Init(config::INIT_SCREEN_WIDTH * 4, config::INIT_SCREEN_HEIGHT * 4);
+	GFX_Init(512 * 3, 256 * 3);
+	GFX_CreateBackBuffer(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
+	pico_control::init();
+	pico_data::load_font_data();
+
+	// TAC08_DETERMINISTIC=1 runs the cart on a virtual clock, see GameLoop. rnd() is seeded
+	// with srand(TAC08_SEED), or srand(0) in deterministic mode. the seed is an integer in the
+	// range of a pico 8 number, -32768 to 32767.
+	const char* deterministic = getenv("TAC08_DETERMINISTIC");
+	const char* seed = getenv("TAC08_SEED");
+	bool is_deterministic = deterministic && strcmp(deterministic, "0") != 0;
+	bool seed_random = seed || is_deterministic;
+	int32_t random_seed = seed ? int32_t(strtol(seed, nullptr, 0)) : 0;
+
+	// --turbo starts in turbo mode, --turbo=n draws every n'th frame in it (0 for none)
+	std::string cart = FILE_GetDefaultCartName();
+	int turbo_draw_every = -1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--turbo") == 0) {
+			DEBUG_Turbo(true);
+		} else if (strncmp(argv[i], "--turbo=", 8) == 0) {
+			DEBUG_Turbo(true);
+			turbo_draw_every = std::max(0, atoi(argv[i] + 8));
+		} else {
+			cart = argv[i];
+		}
+	}
+
+	// TAC08_RECORD=file logs the input of every frame, TAC08_REPLAY=file plays a log back. the
+	// log keeps the rnd() seed too, a recording without TAC08_SEED picks one.
+	const char* record = getenv("TAC08_RECORD");
+	const char* replay = getenv("TAC08_REPLAY");
+	if (replay) {
+		random_seed = REC_StartReplay(replay);
+		seed_random = true;
+	} else if (record) {
+		if (!seed_random) {
+			auto now = std::chrono::system_clock::now().time_since_epoch().count();
+			random_seed = int32_t(uint64_t(now) % 32768);
+			seed_random = true;
+		}
+		REC_StartRecording(record, random_seed);
+	}
+	if (seed_random) {
+		pico_script::set_random_seed(random_seed);
+	}
+	load_cart(cart);
+
+	// TAC08_FRAME_HASHES=file writes a hash of every frame, TAC08_GOLDEN_HASHES=file checks
+	// them against a list written earlier. see tests/golden.sh
+	const char* frame_hashes = getenv("TAC08_FRAME_HASHES");
+	const char* golden_hashes = getenv("TAC08_GOLDEN_HASHES");
+	if (frame_hashes) {
+		HASH_StartWriting(frame_hashes);
+	}
+	if (golden_hashes) {
+		HASH_StartChecking(golden_hashes);
+	}
+
+	GameLoop loop;
+	loop.deterministic = is_deterministic;
+	if (turbo_draw_every >= 0) {
+		loop.turbo_draw_every = turbo_draw_every;
+	}
+	loop.scheduler.deadline = TIME_GetTime_us();
+
+	// frames that may be run without drawing when the cart can not keep up
+	const char* frameskip = getenv("TAC08_FRAMESKIP");
+	if (frameskip) {
+		loop.scheduler.max_skip = std::max(0, atoi(frameskip));
+	}
+
+	// TAC08_PIPELINED=1 runs the cart on its own thread, see run_pipelined()
+	const char* pipelined = getenv("TAC08_PIPELINED");
+	if (pipelined && strcmp(pipelined, "0") != 0) {
+		run_pipelined(loop);
+	} else {
+		run_single_threaded(loop);
+	}
 
 	return 0;
 }
 
 int main(int argc, char** argv) {
+	int result = 0;
 	try {
 		safe_main(argc, argv);
-	} catch (gfx_exception& err) {
-	} catch (pico_script::error& err) {
-	} catch (pico_cart::error& err) {
 	} catch (std::exception& err) {
+		// the cart failed to load or the hal failed to start
+		fprintf(stderr, "%s\n", err.what());
+		result = 1;
 	}
 
+	REC_Stop();
+	if (!HASH_Stop()) {
+		result = 1;
+	}
 	pico_script::unload_scripting();
 	GFX_End();
 
-	return 0;
+	return result;
 }
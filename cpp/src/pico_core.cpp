@@ -117,42 +117,17 @@ static uint32_t displayAreaY = 0;
 static uint32_t globalTime = 0;
 
 static pico_ram::RAM ram;
-static pico_ram::SplitNibbleMemoryArea mem_gfx(spriteSheet.sprite_data,
-                                               pico_ram::MEM_GFX_ADDR,
-                                               pico_ram::MEM_GFX_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_gfx2(spriteSheet.sprite_data + 128 * 64,
-                                                pico_ram::MEM_GFX2_MAP2_ADDR,
-                                                pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::LinearMemoryArea mem_map2(mapSheet.map_data + 128 * 32,
-                                           pico_ram::MEM_GFX2_MAP2_ADDR,
-                                           pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::DualMemoryArea mem_gfx2_map2(&mem_map2,
-                                              &mem_gfx2);  // shared memory between gfx2 & map2
-static pico_ram::LinearMemoryArea mem_map(mapSheet.map_data,
-                                          pico_ram::MEM_MAP_ADDR,
-                                          pico_ram::MEM_MAP_SIZE);
-static pico_ram::LinearMemoryArea mem_flags(spriteSheet.flags,
-                                            pico_ram::MEM_GFX_PROPS_ADDR,
-                                            pico_ram::MEM_GFX_PROPS_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_screen(backbuffer,
-                                                  pico_ram::MEM_SCREEN_ADDR,
-                                                  pico_ram::MEM_SCREEN_SIZE);
-
-static pico_ram::LinearMemoryAreaDF mem_cart_data(cart_data,
-                                                  pico_ram::MEM_CART_DATA_ADDR,
-                                                  pico_ram::MEM_CART_DATA_SIZE);
-
-static pico_ram::LinearMemoryArea mem_scratch_data(scratch_data,
-                                                   pico_ram::MEM_SCRATCH_ADDR,
-                                                   pico_ram::MEM_SCRATCH_SIZE);
-
-static pico_ram::LinearMemoryArea mem_music_data(music_data,
-                                                 pico_ram::MEM_MUSIC_ADDR,
-                                                 pico_ram::MEM_MUSIC_SIZE);
-
-static pico_ram::LinearMemoryArea mem_sfx_data(sfx_data,
-                                               pico_ram::MEM_SFX_ADDR,
-                                               pico_ram::MEM_SFX_SIZE);
+// set by writes to the cart data
+static bool cart_data_dirty = false;
+
+#ifndef TAC08_NO_PACKED_SCREEN
+// the screen memory packed 4 bits per pixel, the way pico 8 stores it. the renderer needs the
+// backbuffer at 8 bits per pixel for the extended palettes and screen sizes, so it is kept as
+// well: reads of 0x6000-0x7fff are plain reads of this copy, writes go to both and pixels the
+// renderer drew are packed again before the memory is next read. build with
+// TAC08_NO_PACKED_SCREEN to read the backbuffer directly instead.
+static uint8_t packed_screen[pico_ram::MEM_SCREEN_SIZE];
+#endif
 
 static uint8_t cartrom[0x4300];
 
@@ -185,6 +160,7 @@ namespace pico_private {
 
 	void copy_data_to_sprites(SpriteSheet& sprites, const std::string& data, bool bits8) {
 		uint16_t i = 0;
+		pico_control::invalidate_sprite_cache();
 
 		for (size_t n = 0; n < data.length(); n++) {
 			char buf[3] = {0};
@@ -203,6 +179,94 @@ namespace pico_private {
 		}
 	}
 
+	// the bulk memory operations work on ranges that do not wrap past 0x7fff, the callers split
+	// them. these do for a range what peek & poke do for a single byte.
+
+	// brings the packed screen memory up to date with what has been drawn
+	void pack_screen() {
+#ifndef TAC08_NO_PACKED_SCREEN
+		int begin;
+		int end;
+		pico_control::get_unpacked_pixels(begin, end);
+		end = std::min(end, pico_ram::MEM_SCREEN_SIZE * 2);
+		if (begin < end) {
+			int first = begin / 2;
+			pico_ram::pack_nibbles(packed_screen + first, backbuffer + first * 2,
+			                       (end + 1) / 2 - first);
+		}
+		pico_control::clear_unpacked_pixels();
+#endif
+	}
+
+	// recorded draw commands read the sprites, map & flags and write the screen, they have to be
+	// run before that memory is read or written
+	void flush_for_range(uint16_t a, uint32_t len, bool write) {
+		uint32_t end = a + len;
+		if (end > pico_ram::MEM_SCREEN_ADDR || (write && a < pico_ram::MEM_MUSIC_ADDR)) {
+			pico_control::flush_draw_commands();
+		}
+		if (end > pico_ram::MEM_SCREEN_ADDR && !write) {
+			pack_screen();
+		}
+	}
+
+	// invalidates the caches of and marks dirty whatever a write to the range changed
+	void mark_range_written(uint16_t a, uint32_t len) {
+		uint32_t end = a + len;
+		if (a < pico_ram::MEM_MUSIC_ADDR) {
+			uint32_t gfx_end = std::min<uint32_t>(end, pico_ram::MEM_GFX_PROPS_ADDR);
+			if (gfx_end > a && gfx_end - a > 256) {
+				// cheaper to drop all the sprite & map caches than to mark this many entries
+				pico_control::invalidate_sprite_cache();
+			} else {
+				for (uint32_t i = a; i < gfx_end; i++) {
+					if (i < pico_ram::MEM_MAP_ADDR) {
+						pico_control::invalidate_sprite_cache((i % 64) * 2, i / 64);
+					}
+					if (i >= pico_ram::MEM_GFX2_MAP2_ADDR && i < pico_ram::MEM_MAP_ADDR) {
+						uint32_t offset = i - pico_ram::MEM_GFX2_MAP2_ADDR;
+						pico_control::invalidate_map_cache(offset % 128, 32 + offset / 128);
+					} else if (i >= pico_ram::MEM_MAP_ADDR) {
+						uint32_t offset = i - pico_ram::MEM_MAP_ADDR;
+						pico_control::invalidate_map_cache(offset % 128, offset / 128);
+					}
+				}
+			}
+			uint32_t flags_start = std::max<uint32_t>(a, pico_ram::MEM_GFX_PROPS_ADDR);
+			uint32_t flags_end = std::min<uint32_t>(end, pico_ram::MEM_MUSIC_ADDR);
+			for (uint32_t i = flags_start; i < flags_end; i++) {
+				pico_control::invalidate_sprite_flags(i - pico_ram::MEM_GFX_PROPS_ADDR);
+			}
+		}
+		if (a < pico_ram::MEM_DRAW_STATE_ADDR && end > pico_ram::MEM_CART_DATA_ADDR) {
+			cart_data_dirty = true;
+		}
+		if (end > pico_ram::MEM_SCREEN_ADDR) {
+			// each byte holds 2 pixels of the same row
+			uint32_t first = std::max<uint32_t>(a, pico_ram::MEM_SCREEN_ADDR);
+			int y0 = ((first - pico_ram::MEM_SCREEN_ADDR) * 2) / buffer_size_x;
+			int y1 = ((end - 1 - pico_ram::MEM_SCREEN_ADDR) * 2) / buffer_size_x + 1;
+			pico_control::mark_screen_dirty(y0, y1);
+		}
+	}
+
+	void read_range(uint16_t a, uint8_t* out, uint32_t len) {
+		if (len == 0) {
+			return;
+		}
+		flush_for_range(a, len, false);
+		ram.read(a, out, len);
+	}
+
+	void write_range(uint16_t a, const uint8_t* in, uint32_t len) {
+		if (len == 0) {
+			return;
+		}
+		flush_for_range(a, len, true);
+		ram.write(a, in, len);
+		mark_range_written(a, len);
+	}
+
 }  // namespace pico_private
 
 namespace pico_control {
@@ -229,33 +293,43 @@ namespace pico_control {
 		pico_control::set_mapbuffer(mapSheet.map_data);
 		pico_control::set_fontbuffer(fontSheet.sprite_data);
 
-		mem_screen.setData(backbuffer);
-
 		pauseMenuActive = false;
 
-		ram.addMemoryArea(&mem_gfx);
-		ram.addMemoryArea(&mem_gfx2_map2);
-		ram.addMemoryArea(&mem_map);
-		ram.addMemoryArea(&mem_flags);
-		ram.addMemoryArea(&mem_screen);
-		ram.addMemoryArea(&mem_cart_data);
-		ram.addMemoryArea(&mem_scratch_data);
-		ram.addMemoryArea(&mem_music_data);
-		ram.addMemoryArea(&mem_sfx_data);
+		using namespace pico_ram;
+		ram.mapNibbles(MEM_GFX_ADDR, MEM_GFX_SIZE, spriteSheet.sprite_data);
+		// the lower half of the map shares its memory with the lower half of the sprite sheet
+		ram.mapDual(MEM_GFX2_MAP2_ADDR, MEM_GFX2_MAP2_SIZE, mapSheet.map_data + 128 * 32,
+		            spriteSheet.sprite_data + 128 * 64);
+		ram.mapLinear(MEM_MAP_ADDR, MEM_MAP_SIZE, mapSheet.map_data);
+		ram.mapLinear(MEM_GFX_PROPS_ADDR, MEM_GFX_PROPS_SIZE, spriteSheet.flags);
+		ram.mapLinear(MEM_MUSIC_ADDR, MEM_MUSIC_SIZE, music_data);
+		ram.mapLinear(MEM_SFX_ADDR, MEM_SFX_SIZE, sfx_data);
+		ram.mapLinear(MEM_SCRATCH_ADDR, MEM_SCRATCH_SIZE, scratch_data);
+		ram.mapLinear(MEM_CART_DATA_ADDR, MEM_CART_DATA_SIZE, cart_data);
+		ram.mapIO(MEM_DRAW_STATE_ADDR, MEM_DRAW_STATE_SIZE, pico_api::gfx_peek,
+		          pico_api::gfx_poke);
+#ifndef TAC08_NO_PACKED_SCREEN
+		pico_ram::pack_nibbles(packed_screen, backbuffer, MEM_SCREEN_SIZE);
+		pico_control::clear_unpacked_pixels();
+		ram.mapDual(MEM_SCREEN_ADDR, MEM_SCREEN_SIZE, packed_screen, backbuffer);
+#else
+		ram.mapNibbles(MEM_SCREEN_ADDR, MEM_SCREEN_SIZE, backbuffer);
+#endif
 	}
 
 	void frame_start() {
 	}
 
 	void frame_end() {
-		if (mem_cart_data.isDirty()) {
-			mem_cart_data.clearDirty();
+		if (cart_data_dirty) {
+			cart_data_dirty = false;
 		}
 		if (pauseMenuRequested)
 			begin_pause_menu();
 	}
 
 	pico_api::colour_t* get_buffer(int& width, int& height) {
+		flush_draw_commands();
 		width = buffer_size_x;
 		height = buffer_size_y;
 		return backbuffer;
@@ -283,6 +357,7 @@ namespace pico_control {
 
 	void set_font_data(std::string data) {
 		pico_private::copy_data_to_sprites(*currentFontData, data, false);
+		pico_control::invalidate_font_cache();
 	}
 
 	void set_map_data(std::string data) {
@@ -390,11 +465,11 @@ namespace pico_api {
 
 	uint8_t peek(uint16_t a) {
 		a = a & 0x7fff;
-		if (a >= 0x5f00 && a <= 0x5f3f) {
-			return gfx_peek(a);
-		} else {
-			return ram.peek(a);
+		if (a >= pico_ram::MEM_SCREEN_ADDR) {
+			pico_control::flush_draw_commands();
+			pico_private::pack_screen();
 		}
+		return ram.peek(a);
 	}
 
 	uint16_t peek2(uint16_t a) {
@@ -413,11 +488,33 @@ namespace pico_api {
 
 	void poke(uint16_t a, uint8_t v) {
 		a = a & 0x7fff;
-		if (a >= 0x5f00 && a <= 0x5f3f) {
-			gfx_poke(a, v);
-		} else {
-			ram.poke(a, v);
+		if (a < pico_ram::MEM_MUSIC_ADDR || a >= pico_ram::MEM_SCREEN_ADDR) {
+			// recorded draw commands read the sprites, map & flags and write the screen
+			pico_control::flush_draw_commands();
+			if (a < pico_ram::MEM_MAP_ADDR) {
+				// sprite sheet, each byte holds 2 pixels of the same sprite
+				pico_control::invalidate_sprite_cache((a % 64) * 2, a / 64);
+			}
+			if (a >= pico_ram::MEM_GFX2_MAP2_ADDR && a < pico_ram::MEM_MAP_ADDR) {
+				// lower half of the map, shared with the sprite sheet
+				uint16_t offset = a - pico_ram::MEM_GFX2_MAP2_ADDR;
+				pico_control::invalidate_map_cache(offset % 128, 32 + offset / 128);
+			} else if (a >= pico_ram::MEM_MAP_ADDR && a < pico_ram::MEM_GFX_PROPS_ADDR) {
+				uint16_t offset = a - pico_ram::MEM_MAP_ADDR;
+				pico_control::invalidate_map_cache(offset % 128, offset / 128);
+			} else if (a >= pico_ram::MEM_GFX_PROPS_ADDR) {
+				if (a < pico_ram::MEM_MUSIC_ADDR) {
+					pico_control::invalidate_sprite_flags(a - pico_ram::MEM_GFX_PROPS_ADDR);
+				} else {
+					// each byte holds 2 pixels of the same row
+					int y = ((a - pico_ram::MEM_SCREEN_ADDR) * 2) / buffer_size_x;
+					pico_control::mark_screen_dirty(y, y + 1);
+				}
+			}
+		} else if (a >= pico_ram::MEM_CART_DATA_ADDR && a < pico_ram::MEM_DRAW_STATE_ADDR) {
+			cart_data_dirty = true;
 		}
+		ram.poke(a, v);
 	}
 
 	void poke2(uint16_t a, uint16_t v) {
@@ -432,24 +529,67 @@ namespace pico_api {
 		poke(a + 3, v >> 24);
 	}
 
+	// the bulk operations are split where they wrap from 0x7fff back to 0, like a loop of
+	// pokes would
 	void memory_set(uint16_t a, uint8_t val, uint16_t len) {
-		for (uint32_t i = 0; i < len; i++) {
-			poke(a + i, val);
+		a = a & 0x7fff;
+		uint32_t remaining = len;
+		while (remaining) {
+			uint32_t n = std::min<uint32_t>(remaining, 0x8000 - a);
+			pico_private::flush_for_range(a, n, true);
+			ram.fill(a, val, n);
+			pico_private::mark_range_written(a, n);
+			a = (a + n) & 0x7fff;
+			remaining -= n;
 		}
 	}
 
+	// copies as if through a temporary buffer, so overlapping ranges work like memmove()
 	void memory_cpy(uint16_t dest_a, uint16_t src_a, uint16_t len) {
-		if (uint32_t(dest_a) - uint32_t(src_a) >= len) {
-			for (uint32_t i = 0; i < len; i++) {
-				poke(dest_a + i, peek(src_a + i));
-			}
-		} else {
-			src_a += len;
-			dest_a += len;
-			for (int32_t i = len - 1; i >= 0; i--) {
-				poke(dest_a - i, peek(src_a - i));
+		dest_a = dest_a & 0x7fff;
+		src_a = src_a & 0x7fff;
+		uint32_t count = std::min<uint32_t>(len, 0x8000);
+		if (count == 0) {
+			return;
+		}
+
+		if (dest_a + count <= 0x8000 && src_a + count <= 0x8000) {
+			uint8_t* dest = ram.linear(dest_a, count);
+			const uint8_t* src = ram.readable(src_a, count);
+			if (dest && src) {
+				pico_private::flush_for_range(src_a, count, false);
+				pico_private::flush_for_range(dest_a, count, true);
+				memmove(dest, src, count);
+				pico_private::mark_range_written(dest_a, count);
+				return;
 			}
 		}
+
+		static uint8_t buffer[0x8000];
+		memory_read(src_a, buffer, count);
+		memory_write(dest_a, buffer, count);
+	}
+
+	void memory_read(uint16_t a, uint8_t* out, uint32_t len) {
+		a = a & 0x7fff;
+		while (len) {
+			uint32_t n = std::min<uint32_t>(len, 0x8000 - a);
+			pico_private::read_range(a, out, n);
+			a = (a + n) & 0x7fff;
+			out += n;
+			len -= n;
+		}
+	}
+
+	void memory_write(uint16_t a, const uint8_t* in, uint32_t len) {
+		a = a & 0x7fff;
+		while (len) {
+			uint32_t n = std::min<uint32_t>(len, 0x8000 - a);
+			pico_private::write_range(a, in, n);
+			a = (a + n) & 0x7fff;
+			in += n;
+			len -= n;
+		}
 	}
 
 	uint32_t dget(uint16_t a) {
@@ -541,10 +681,14 @@ namespace pico_api {
 	}
 
 	void reload(uint16_t dest_addr, uint16_t source_addr, uint16_t len) {
-		len = std::min<uint16_t>(len, 0x4300);
-		for (uint16_t n = 0; n < len; n++) {
-			poke(dest_addr + n, cartrom[source_addr + n]);
-		}
+		// bytes past the end of the cart rom read as 0
+		static uint8_t buffer[0x4300];
+		uint32_t count = std::min<uint32_t>(len, sizeof(buffer));
+		uint32_t available = source_addr < sizeof(cartrom) ? sizeof(cartrom) - source_addr : 0;
+		uint32_t n = std::min(count, available);
+		memcpy(buffer, cartrom + source_addr, n);
+		memset(buffer + n, 0, count - n);
+		memory_write(dest_addr, buffer, count);
 	}
 
 }  // namespace pico_api
@@ -29,6 +29,9 @@ namespace pico_api {
 
 	void memory_set(uint16_t a, uint8_t val, uint16_t len);
 	void memory_cpy(uint16_t dest_a, uint16_t src_a, uint16_t len);
+	// len bytes from or to a, the same as that many peeks or pokes
+	void memory_read(uint16_t a, uint8_t* out, uint32_t len);
+	void memory_write(uint16_t a, const uint8_t* in, uint32_t len);
 
 	uint32_t dget(uint16_t a);
 	void dset(uint16_t a, uint32_t v);
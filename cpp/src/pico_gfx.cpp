@@ -1,9 +1,14 @@
 #include "pico_gfx.h"
+#include "config.h"
+#include "simd.h"
 #include "utils.h"
 
 #include <string.h>
+#include <algorithm>
 #include <array>
+#include <initializer_list>
 #include <map>
+#include <vector>
 
 #include "utf8-util.h"
 
@@ -20,6 +25,15 @@ static pico_api::colour_t* fontbuffer = nullptr;
 
 static std::array<pico_api::colour_t, 256> screen_palette;
 
+// rows of the backbuffer drawn to since the last present, non zero when dirty. lets the present
+// stage convert only the rows that have changed.
+static std::array<uint8_t, config::MAX_SCREEN_HEIGHT> dirty_rows;
+
+// pixels [unpacked_begin, unpacked_end) of the backbuffer may have been drawn to since the core
+// last brought its packed copy of the screen memory up to date
+static int unpacked_begin = 0;
+static int unpacked_end = 0;
+
 struct GraphicsState {
 	pico_api::colour_t fg = 7;
 	pico_api::colour_t bg = 0;
@@ -41,19 +55,215 @@ struct GraphicsState {
 	std::array<pico_api::colour_t, 256> palette_map;
 	std::array<bool, 256> transparent;
 	bool extendedPalette = false;
+	bool palette_identity = true;
+	bool transparent_only0 = true;
+	// bit n set if colour n is transparent, for colours 0-15
+	uint16_t transparent_mask = 1;
 };
 
 static GraphicsState* currentGraphicsState = nullptr;
 static std::map<int, GraphicsState> extendedGraphicsStates;
 
+// cache of which pixels of each 8x8 sprite in the current sprite sheet are drawn (not
+// transparent). one byte per sprite row, bit n set if pixel n of the row is opaque. an entry
+// is valid when its generation matches sprite_opacity_generation and it was built with the
+// current transparent_mask, so changes to the sprite sheet invalidate the whole cache in one
+// step and palt() only rebuilds the entries it is drawn with.
+struct SpriteOpacity {
+	uint32_t generation = 0;
+	uint16_t transparent_mask = 0;
+	// colours 0-15 that are not transparent, drawn without a test
+	uint8_t rows[8];
+	// pixels that may be drawn: the opaque ones plus any colour above 15, which are tested
+	uint8_t drawn[8];
+	bool empty;
+};
+
+static std::array<SpriteOpacity, 256> sprite_opacity;
+static uint32_t sprite_opacity_generation = 1;
+
+// pre-rendered map region used by map() when the map cache is enabled. holds the region as it
+// would be drawn with the palette & transparency it was rendered with: one colour and one mask
+// byte (0xff where a pixel is drawn) per pixel. cells are re-rendered lazily when marked dirty
+// by mset/fset/sset or pokes into the map, flags or sprite sheet memory.
+struct MapCache {
+	bool used = false;
+	uint32_t last_used = 0;
+	int cell_x = 0;
+	int cell_y = 0;
+	int cell_w = 0;
+	int cell_h = 0;
+	uint8_t layer = 0;
+	const pico_api::colour_t* spritebuffer = nullptr;
+	const uint8_t* spriteflags = nullptr;
+	const uint8_t* mapbuffer = nullptr;
+	std::array<pico_api::colour_t, 256> palette_map;
+	std::array<bool, 256> transparent;
+	std::vector<pico_api::colour_t> pixels;
+	std::vector<uint8_t> mask;
+	std::vector<uint8_t> dirty;             // one entry per cell
+	std::array<bool, 256> dirty_sprites;  // sprites changed since the cells were checked
+	bool any_dirty_sprites = false;
+};
+
+// the current fill pattern expanded into one colour and one mask row per pattern row. each row
+// repeats every 4 pixels and is long enough that a 16 byte block can be read starting at any
+// x & 3 offset. rebuilt whenever the pattern, its transparency or the mapped pen colours change.
+struct FillTemplate {
+	bool valid = false;
+	uint16_t pattern = 0;
+	bool transparent = false;
+	pico_api::colour_t fg = 0;
+	pico_api::colour_t bg = 0;
+	bool solid = false;  // every pixel drawn with solid_colour
+	bool empty = false;  // nothing drawn
+	pico_api::colour_t solid_colour = 0;
+	pico_api::colour_t colour[4][32];
+	uint8_t mask[4][32];  // 0xff where the pixel is drawn
+};
+
+static FillTemplate fill_template;
+
+// 1 bit masks of the glyphs in the current font sheet, indexed by character. bit n of a row is
+// set when pixel n is drawn in the pen colour (font colour 7). glyphs that use any colour other
+// than 0 & 7 are not plain and are drawn through the blitter.
+struct GlyphCache {
+	bool valid = false;
+	uint8_t rows[256][5];
+	bool plain[256];
+};
+
+static GlyphCache glyph_cache;
+
+// per frame buffer of draw commands, used when pico_apix::drawbuffer is enabled. commands hold
+// coordinates with the camera already applied and an index into draw_states, which holds the
+// parts of the graphics state the rasterizer reads. consecutive commands share states, and
+// states share palettes, while they are unchanged.
+enum class DrawOp : uint8_t { Cls, Pset, Rect, RectFill, Circ, CircFill, Line, Blit, StretchBlit, Map };
+
+struct DrawPalette {
+	std::array<pico_api::colour_t, 256> palette_map;
+	std::array<bool, 256> transparent;
+};
+
+struct DrawState {
+	pico_api::colour_t fg;
+	pico_api::colour_t bg;
+	uint16_t pattern;
+	bool pattern_transparent;
+	int clip_x1;
+	int clip_y1;
+	int clip_x2;
+	int clip_y2;
+	uint32_t palette;
+
+	bool operator==(const DrawState& o) const {
+		return fg == o.fg && bg == o.bg && pattern == o.pattern &&
+		       pattern_transparent == o.pattern_transparent && clip_x1 == o.clip_x1 &&
+		       clip_y1 == o.clip_y1 && clip_x2 == o.clip_x2 && clip_y2 == o.clip_y2 &&
+		       palette == o.palette;
+	}
+};
+
+struct DrawCommand {
+	DrawOp op;
+	bool flip_x;
+	bool flip_y;
+	uint8_t layer;
+	uint32_t state;
+	int32_t args[8];
+};
+
+static bool draw_buffer_enabled = false;
+static std::vector<DrawCommand> draw_commands;
+static std::vector<DrawState> draw_states;
+static std::vector<DrawPalette> draw_palettes;
+
+// bumped whenever a palette or transparency table changes, so recording can tell if the last
+// recorded palette is still current.
+static uint32_t palette_generation = 0;
+static uint32_t recorded_palette_generation = 0;
+static const GraphicsState* recorded_palette_state = nullptr;
+
+static bool map_cache_enabled = false;
+static std::array<MapCache, 4> map_caches;
+static uint32_t map_cache_clock = 0;
+
 namespace pico_private {
 	using namespace pico_api;
 
+	// identity tables used to detect the default palette / transparency state
+	static std::array<colour_t, 256> make_identity_palette() {
+		std::array<colour_t, 256> p;
+		for (size_t n = 0; n < p.size(); n++) {
+			p[n] = (colour_t)n;
+		}
+		return p;
+	}
+
+	static std::array<bool, 256> make_default_transparency() {
+		std::array<bool, 256> t;
+		t.fill(false);
+		t[0] = true;
+		return t;
+	}
+
+	static const std::array<colour_t, 256> identity_palette = make_identity_palette();
+	static const std::array<bool, 256> default_transparency = make_default_transparency();
+
+	// must be called whenever palette_map or transparent are modified, so the blitter
+	// can select the specialised kernels.
+	static void update_palette_flags() {
+		GraphicsState* gs = currentGraphicsState;
+		gs->palette_identity = gs->palette_map == identity_palette;
+		gs->transparent_only0 = gs->transparent == default_transparency;
+		gs->transparent_mask = 0;
+		for (int c = 0; c < 16; c++) {
+			gs->transparent_mask |= gs->transparent[c] ? (1 << c) : 0;
+		}
+		palette_generation++;
+	}
+
+	static void invalidate_sprite_opacity() {
+		sprite_opacity_generation++;
+	}
+
+	static const SpriteOpacity& get_sprite_opacity(int n) {
+		SpriteOpacity& so = sprite_opacity[n];
+		uint16_t transparent_mask = currentGraphicsState->transparent_mask;
+		if (so.generation != sprite_opacity_generation || so.transparent_mask != transparent_mask) {
+			const colour_t* spr = spritebuffer + (n / 16) * 8 * 128 + (n % 16) * 8;
+			uint8_t any = 0;
+			for (int y = 0; y < 8; y++) {
+				uint8_t opaque = 0;
+				uint8_t drawn = 0;
+				for (int x = 0; x < 8; x++) {
+					colour_t c = spr[x];
+					if (c > 15) {
+						drawn |= (1 << x);
+					} else if (!(transparent_mask & (1 << c))) {
+						opaque |= (1 << x);
+						drawn |= (1 << x);
+					}
+				}
+				so.rows[y] = opaque;
+				so.drawn[y] = drawn;
+				any |= drawn;
+				spr += 128;
+			}
+			so.empty = (any == 0);
+			so.generation = sprite_opacity_generation;
+			so.transparent_mask = transparent_mask;
+		}
+		return so;
+	}
+
 	static void restore_palette() {
 		for (size_t n = 0; n < currentGraphicsState->palette_map.size(); n++) {
 			currentGraphicsState->palette_map[n] = (colour_t)n;
 			screen_palette[n] = (colour_t)n;
 		}
+		update_palette_flags();
 	}
 
 	static void restore_transparency() {
@@ -61,6 +271,7 @@ namespace pico_private {
 			currentGraphicsState->transparent[n] = false;
 		}
 		currentGraphicsState->transparent[0] = true;
+		update_palette_flags();
 	}
 
 	// test if rectangle is within cliping rectangle
@@ -79,6 +290,353 @@ namespace pico_private {
 		return true;
 	}
 
+	static inline void mark_unpacked(int begin, int end) {
+		if (unpacked_begin == unpacked_end) {
+			unpacked_begin = begin;
+			unpacked_end = end;
+		} else {
+			unpacked_begin = std::min(unpacked_begin, begin);
+			unpacked_end = std::max(unpacked_end, end);
+		}
+	}
+
+	// marks rows y0 to y1 - 1 of the backbuffer as drawn to, they have changed since the last
+	// present and have to be packed into the screen memory again
+	static inline void mark_dirty_rows(int y0, int y1) {
+		y0 = std::max(y0, 0);
+		y1 = std::min(y1, buffer_size_y);
+		if (y0 < y1) {
+			memset(dirty_rows.data() + y0, 1, y1 - y0);
+			mark_unpacked(y0 * buffer_size_x, y1 * buffer_size_x);
+		}
+	}
+
+	// draws a single pixel with the full palette & transparency lookup. used for the parts of
+	// a span the vector kernels can not handle.
+	inline void blit_pixel(colour_t* pix,
+	                       colour_t c,
+	                       const colour_t* palette_map,
+	                       const bool* transparent) {
+		if (!transparent[c]) {
+			*pix = palette_map[c];
+		}
+	}
+
+#if defined(TAC08_SIMD_SSSE3) || defined(TAC08_SIMD_NEON)
+	static_assert(sizeof(bool) == 1, "vector kernels load the transparency table as bytes");
+
+	// vector span kernel. the first 16 entries of the palette and transparency tables are
+	// loaded into registers and used as byte shuffle lookup tables, so a block of 16 (or 32 with
+	// AVX2) sprite pixels is remapped with one shuffle and blended with a mask. blocks that
+	// contain colours >= 16 are done with the scalar lookup. returns the number of pixels
+	// processed, the caller draws the remaining tail.
+	template <bool FLIP_X>
+	static int blit_span_simd(colour_t* pix,
+	                          const colour_t* spr,
+	                          int w,
+	                          const colour_t* palette_map,
+	                          const bool* transparent) {
+		int x = 0;
+#if defined(TAC08_SIMD_SSSE3)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i high = _mm_set1_epi8((char)0xf0);
+		const __m128i lut = _mm_loadu_si128((const __m128i*)palette_map);
+		const __m128i tlut = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)transparent), zero);
+		const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+#if defined(TAC08_SIMD_AVX2)
+		const __m256i zero32 = _mm256_setzero_si256();
+		const __m256i high32 = _mm256_set1_epi8((char)0xf0);
+		const __m256i lut32 = _mm256_broadcastsi128_si256(lut);
+		const __m256i tlut32 = _mm256_broadcastsi128_si256(tlut);
+		const __m256i reverse32 = _mm256_broadcastsi128_si256(reverse);
+
+		for (; x + 32 <= w; x += 32) {
+			__m256i c;
+			if (FLIP_X) {
+				// reverse the bytes in each lane then swap the lanes
+				c = _mm256_loadu_si256((const __m256i*)(spr - x - 31));
+				c = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(c, reverse32), 0x4e);
+			} else {
+				c = _mm256_loadu_si256((const __m256i*)(spr + x));
+			}
+			if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(c, high32), zero32)) != -1) {
+				for (int n = 0; n < 32; n++) {
+					blit_pixel(pix + x + n, FLIP_X ? spr[-(x + n)] : spr[x + n], palette_map,
+					           transparent);
+				}
+				continue;
+			}
+			__m256i dst = _mm256_loadu_si256((const __m256i*)(pix + x));
+			__m256i mapped = _mm256_shuffle_epi8(lut32, c);
+			__m256i skip = _mm256_shuffle_epi8(tlut32, c);
+			_mm256_storeu_si256((__m256i*)(pix + x), _mm256_blendv_epi8(mapped, dst, skip));
+		}
+#endif
+
+		for (; x + 16 <= w; x += 16) {
+			__m128i c;
+			if (FLIP_X) {
+				c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(spr - x - 15)), reverse);
+			} else {
+				c = _mm_loadu_si128((const __m128i*)(spr + x));
+			}
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(c, high), zero)) != 0xffff) {
+				for (int n = 0; n < 16; n++) {
+					blit_pixel(pix + x + n, FLIP_X ? spr[-(x + n)] : spr[x + n], palette_map,
+					           transparent);
+				}
+				continue;
+			}
+			__m128i dst = _mm_loadu_si128((const __m128i*)(pix + x));
+			__m128i mapped = _mm_shuffle_epi8(lut, c);
+			__m128i skip = _mm_shuffle_epi8(tlut, c);
+			_mm_storeu_si128((__m128i*)(pix + x),
+			                 _mm_or_si128(_mm_and_si128(skip, dst), _mm_andnot_si128(skip, mapped)));
+		}
+#elif defined(TAC08_SIMD_NEON)
+		const uint8x16_t lut = vld1q_u8(palette_map);
+		const uint8x16_t tlut = vcgtq_u8(vld1q_u8((const uint8_t*)transparent), vdupq_n_u8(0));
+		const uint8x16_t limit = vdupq_n_u8(15);
+
+		for (; x + 16 <= w; x += 16) {
+			uint8x16_t c;
+			if (FLIP_X) {
+				uint8x16_t r = vrev64q_u8(vld1q_u8(spr - x - 15));
+				c = vextq_u8(r, r, 8);
+			} else {
+				c = vld1q_u8(spr + x);
+			}
+			uint8x16_t out_of_range = vcgtq_u8(c, limit);
+			uint64x2_t any = vreinterpretq_u64_u8(out_of_range);
+			if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) != 0) {
+				for (int n = 0; n < 16; n++) {
+					blit_pixel(pix + x + n, FLIP_X ? spr[-(x + n)] : spr[x + n], palette_map,
+					           transparent);
+				}
+				continue;
+			}
+#if defined(__aarch64__)
+			uint8x16_t mapped = vqtbl1q_u8(lut, c);
+			uint8x16_t skip = vqtbl1q_u8(tlut, c);
+#else
+			uint8x8x2_t lut2 = {{vget_low_u8(lut), vget_high_u8(lut)}};
+			uint8x8x2_t tlut2 = {{vget_low_u8(tlut), vget_high_u8(tlut)}};
+			uint8x16_t mapped = vcombine_u8(vtbl2_u8(lut2, vget_low_u8(c)),
+			                                vtbl2_u8(lut2, vget_high_u8(c)));
+			uint8x16_t skip = vcombine_u8(vtbl2_u8(tlut2, vget_low_u8(c)),
+			                              vtbl2_u8(tlut2, vget_high_u8(c)));
+#endif
+			vst1q_u8(pix + x, vbslq_u8(skip, vld1q_u8(pix + x), mapped));
+		}
+#endif
+		return x;
+	}
+#endif
+
+	// blits one row of a sprite. the template parameters are resolved at compile time so the
+	// common cases do not test flip_x or look up the palette/transparency tables per pixel.
+	// when FIXED_W is non zero the width is known and the loop is fully unrolled.
+	template <bool FLIP_X, bool IDENTITY_PAL, bool ONLY_0_TRANSPARENT, int FIXED_W>
+	static inline void blit_row(colour_t* pix,
+	                            const colour_t* spr,
+	                            int w,
+	                            const colour_t* palette_map,
+	                            const bool* transparent) {
+		if (FIXED_W) {
+			w = FIXED_W;
+		}
+		int start = 0;
+#if defined(TAC08_SIMD_SSSE3) || defined(TAC08_SIMD_NEON)
+		// sprite rows are usually too narrow for the vector kernel to pay off, and the compiler
+		// already vectorises the identity palette case on its own.
+		if (!FIXED_W && !(IDENTITY_PAL && ONLY_0_TRANSPARENT) && w >= 16) {
+			start = blit_span_simd<FLIP_X>(pix, spr, w, palette_map, transparent);
+		}
+#endif
+		// written as a select rather than a branch so it does not stall on sprites with a
+		// lot of transparent pixels, and so the compiler can vectorise the simple cases.
+		for (int x = start; x < w; x++) {
+			colour_t c = FLIP_X ? spr[-x] : spr[x];
+			bool draw = ONLY_0_TRANSPARENT ? c != 0 : !transparent[c];
+			pix[x] = draw ? (IDENTITY_PAL ? c : palette_map[c]) : pix[x];
+		}
+	}
+
+	// spr is the first sprite pixel to be drawn (the rightmost one when flipped) of the first
+	// row. rows wrap around the sprite sheet vertically, the caller guarantees that columns
+	// do not wrap.
+	template <bool FLIP_X, bool FLIP_Y, bool IDENTITY_PAL, bool ONLY_0_TRANSPARENT, int FIXED_W>
+	static void blit_rect(colour_t* pix,
+	                      const colour_t* spritebuffer,
+	                      int spr_x,
+	                      int spr_y,
+	                      int scr_w,
+	                      int scr_h,
+	                      const colour_t* palette_map,
+	                      const bool* transparent) {
+		for (int y = 0; y < scr_h; y++) {
+			const colour_t* spr = spritebuffer + ((spr_y + (FLIP_Y ? -y : y)) & 0x7f) * 128 + spr_x;
+			blit_row<FLIP_X, IDENTITY_PAL, ONLY_0_TRANSPARENT, FIXED_W>(pix, spr, scr_w, palette_map,
+			                                                           transparent);
+			pix += buffer_size_x;
+		}
+	}
+
+	typedef void (*blit_rect_fn)(colour_t* pix,
+	                             const colour_t* spritebuffer,
+	                             int spr_x,
+	                             int spr_y,
+	                             int scr_w,
+	                             int scr_h,
+	                             const colour_t* palette_map,
+	                             const bool* transparent);
+
+	typedef void (*blit_row_fn)(colour_t* pix,
+	                            const colour_t* spr,
+	                            int w,
+	                            const colour_t* palette_map,
+	                            const bool* transparent);
+
+	static blit_row_fn select_row_kernel(bool identity, bool only0) {
+		if (identity) {
+			return only0 ? blit_row<false, true, true, 0> : blit_row<false, true, false, 0>;
+		}
+		return only0 ? blit_row<false, false, true, 0> : blit_row<false, false, false, 0>;
+	}
+
+	template <bool FLIP_X, bool FLIP_Y, bool IDENTITY_PAL, bool ONLY_0_TRANSPARENT>
+	static blit_rect_fn select_blit_width(int w) {
+		if (w == 8) {
+			return blit_rect<FLIP_X, FLIP_Y, IDENTITY_PAL, ONLY_0_TRANSPARENT, 8>;
+		}
+		return blit_rect<FLIP_X, FLIP_Y, IDENTITY_PAL, ONLY_0_TRANSPARENT, 0>;
+	}
+
+	template <bool FLIP_X, bool FLIP_Y, bool IDENTITY_PAL>
+	static blit_rect_fn select_blit_transparency(bool only0, int w) {
+		if (only0) {
+			return select_blit_width<FLIP_X, FLIP_Y, IDENTITY_PAL, true>(w);
+		}
+		return select_blit_width<FLIP_X, FLIP_Y, IDENTITY_PAL, false>(w);
+	}
+
+	template <bool FLIP_X, bool FLIP_Y>
+	static blit_rect_fn select_blit_palette(bool identity, bool only0, int w) {
+		if (identity) {
+			return select_blit_transparency<FLIP_X, FLIP_Y, true>(only0, w);
+		}
+		return select_blit_transparency<FLIP_X, FLIP_Y, false>(only0, w);
+	}
+
+	static blit_rect_fn select_blit_kernel(bool flip_x,
+	                                       bool flip_y,
+	                                       bool identity,
+	                                       bool only0,
+	                                       int w) {
+		if (flip_x) {
+			return flip_y ? select_blit_palette<true, true>(identity, only0, w)
+			              : select_blit_palette<true, false>(identity, only0, w);
+		}
+		return flip_y ? select_blit_palette<false, true>(identity, only0, w)
+		              : select_blit_palette<false, false>(identity, only0, w);
+	}
+
+	// draws a run of opaque pixels, no transparency test needed.
+	template <bool FLIP_X, bool IDENTITY_PAL, int FIXED_W>
+	static inline void blit_row_opaque(colour_t* pix,
+	                                   const colour_t* spr,
+	                                   int w,
+	                                   const colour_t* palette_map) {
+		if (FIXED_W) {
+			w = FIXED_W;
+		}
+		if (IDENTITY_PAL && !FLIP_X) {
+			memcpy(pix, spr, w);
+			return;
+		}
+		for (int x = 0; x < w; x++) {
+			colour_t c = FLIP_X ? spr[-x] : spr[x];
+			pix[x] = IDENTITY_PAL ? c : palette_map[c];
+		}
+	}
+
+	// blits from the current sprite sheet using the sprite opacity cache. every row is split at
+	// the 8 pixel sprite boundaries, parts that are fully transparent are skipped and fully
+	// opaque parts are drawn without testing each pixel. min_x & max_x are the first and last
+	// sprite sheet columns drawn and must not wrap.
+	template <bool FLIP_X, bool IDENTITY_PAL, bool ONLY_0_TRANSPARENT>
+	static void blit_rect_cached(colour_t* pix,
+	                             int min_x,
+	                             int max_x,
+	                             int spr_y,
+	                             int dy,
+	                             int scr_h,
+	                             const colour_t* palette_map,
+	                             const bool* transparent) {
+		int first_block = min_x >> 3;
+		int last_block = max_x >> 3;
+
+		for (int y = 0; y < scr_h; y++) {
+			int sy = (spr_y + y * dy) & 0x7f;
+			const colour_t* row = spritebuffer + sy * 128;
+
+			if (y == 0 || (sy & 7) == (dy > 0 ? 0 : 7)) {
+				// entering a new row of sprites, make sure their cache entries are up to date
+				for (int block = first_block; block <= last_block; block++) {
+					get_sprite_opacity((sy >> 3) * 16 + block);
+				}
+			}
+			const SpriteOpacity* so = &sprite_opacity[(sy >> 3) * 16];
+
+			for (int block = first_block; block <= last_block; block++) {
+				int lo = std::max(block * 8, min_x);
+				int hi = std::min(block * 8 + 7, max_x);
+				uint8_t range = (0xff << (lo & 7)) & (0xff >> (7 - (hi & 7)));
+				if ((so[block].drawn[sy & 7] & range) == 0) {
+					continue;
+				}
+				uint8_t mask = so[block].rows[sy & 7] & range;
+
+				colour_t* dst = pix + (FLIP_X ? max_x - hi : lo - min_x);
+				const colour_t* src = row + (FLIP_X ? hi : lo);
+				if (range == 0xff) {
+					// whole sprite row, the width is fixed so the loops are unrolled
+					if (mask == 0xff) {
+						blit_row_opaque<FLIP_X, IDENTITY_PAL, 8>(dst, src, 8, palette_map);
+					} else {
+						blit_row<FLIP_X, IDENTITY_PAL, ONLY_0_TRANSPARENT, 8>(dst, src, 8, palette_map,
+						                                                      transparent);
+					}
+				} else if (mask == range) {
+					blit_row_opaque<FLIP_X, IDENTITY_PAL, 0>(dst, src, hi - lo + 1, palette_map);
+				} else {
+					blit_row<FLIP_X, IDENTITY_PAL, ONLY_0_TRANSPARENT, 0>(dst, src, hi - lo + 1,
+					                                                      palette_map, transparent);
+				}
+			}
+			pix += buffer_size_x;
+		}
+	}
+
+	typedef void (*blit_rect_cached_fn)(colour_t* pix,
+	                                    int min_x,
+	                                    int max_x,
+	                                    int spr_y,
+	                                    int dy,
+	                                    int scr_h,
+	                                    const colour_t* palette_map,
+	                                    const bool* transparent);
+
+	template <bool FLIP_X>
+	static blit_rect_cached_fn select_cached_kernel(bool identity, bool only0) {
+		if (identity) {
+			return only0 ? blit_rect_cached<FLIP_X, true, true>
+			             : blit_rect_cached<FLIP_X, true, false>;
+		}
+		return only0 ? blit_rect_cached<FLIP_X, false, true> : blit_rect_cached<FLIP_X, false, false>;
+	}
+
 	static void blitter(colour_t* spritebuffer,
 	                    int scr_x,
 	                    int scr_y,
@@ -130,28 +688,58 @@ namespace pico_private {
 			scr_h -= nclip;
 		}
 
-		int dy = 1;
 		if (flip_y) {
 			spr_y += spr_h - 1;
-			dy = -dy;
 		}
 
+		const GraphicsState* gs = currentGraphicsState;
 		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		mark_dirty_rows(scr_y, scr_y + scr_h);
+
+		// first and last sprite sheet column read, if these do not wrap around the sheet the
+		// specialised kernels can be used.
+		int first_x = flip_x ? spr_x + spr_w - 1 : spr_x;
+		int min_x = flip_x ? first_x - (scr_w - 1) : first_x;
+		int max_x = flip_x ? first_x : first_x + (scr_w - 1);
+
+		if (min_x >= 0 && max_x < 128) {
+			// blits from the sprite sheet skip transparent runs and copy opaque ones in one go,
+			// except wide ones on builds with a vector kernel, which handles them faster.
+			bool use_cache = spritebuffer == ::spritebuffer;
+#if defined(TAC08_SIMD_SSSE3) || defined(TAC08_SIMD_NEON)
+			use_cache = use_cache && scr_w < 16;
+#endif
+			if (use_cache) {
+				blit_rect_cached_fn kernel =
+				    flip_x ? select_cached_kernel<true>(gs->palette_identity, gs->transparent_only0)
+				           : select_cached_kernel<false>(gs->palette_identity, gs->transparent_only0);
+				kernel(pix, min_x, max_x, spr_y, flip_y ? -1 : 1, scr_h, gs->palette_map.data(),
+				       gs->transparent.data());
+				return;
+			}
+			blit_rect_fn kernel = select_blit_kernel(flip_x, flip_y, gs->palette_identity,
+			                                         gs->transparent_only0, scr_w);
+			kernel(pix, spritebuffer, first_x, spr_y, scr_w, scr_h, gs->palette_map.data(),
+			       gs->transparent.data());
+			return;
+		}
+
+		int dy = flip_y ? -1 : 1;
 		for (int y = 0; y < scr_h; y++) {
 			colour_t* spr = spritebuffer + ((spr_y + y * dy) & 0x7f) * 128;
 
 			if (!flip_x) {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[(spr_x + x) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs->transparent[c]) {
+						pix[x] = gs->palette_map[c];
 					}
 				}
 			} else {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[(spr_x + spr_w - x - 1) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs->transparent[c]) {
+						pix[x] = gs->palette_map[c];
 					}
 				}
 			}
@@ -228,25 +816,29 @@ namespace pico_private {
 			dy = -dy;
 		}
 
+		const GraphicsState* gs = currentGraphicsState;
+		blit_row_fn kernel = select_row_kernel(gs->palette_identity, gs->transparent_only0);
+
+		// each row is gathered from the sprite sheet into a linear span and then drawn with the
+		// same row kernels as the non stretched blitter.
+		colour_t row[config::MAX_SCREEN_WIDTH];
 		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		mark_dirty_rows(scr_y, scr_y + scr_h);
 		for (int y = 0; y < scr_h; y++) {
 			colour_t* spr = spritebuffer + (((spr_y + y * dy) >> 16) & 0x7f) * 128;
 
 			if (!flip_x) {
-				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[((spr_x + x * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
-					}
+				int fx = spr_x;
+				for (int x = 0; x < scr_w; x++, fx += dx) {
+					row[x] = spr[(fx >> 16) & 0x7f];
 				}
 			} else {
-				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[((spr_x + spr_w - (x + 1) * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
-					}
+				int fx = spr_x + spr_w - dx;
+				for (int x = 0; x < scr_w; x++, fx -= dx) {
+					row[x] = spr[(fx >> 16) & 0x7f];
 				}
 			}
+			kernel(pix, row, scr_w, gs->palette_map.data(), gs->transparent.data());
 			pix += buffer_size_x;
 		}
 	}
@@ -278,6 +870,87 @@ namespace pico_private {
 			std::swap(c0, c1);
 	}
 
+	static const FillTemplate& get_fill_template() {
+		const GraphicsState* gs = currentGraphicsState;
+		FillTemplate& ft = fill_template;
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
+
+		if (ft.valid && ft.pattern == gs->pattern && ft.transparent == gs->pattern_transparent &&
+		    ft.fg == fg && ft.bg == bg) {
+			return ft;
+		}
+
+		ft.valid = true;
+		ft.pattern = gs->pattern;
+		ft.transparent = gs->pattern_transparent;
+		ft.fg = fg;
+		ft.bg = bg;
+		ft.solid = ft.pattern == 0 || (ft.pattern == 0xffff && !ft.transparent);
+		ft.empty = ft.pattern == 0xffff && ft.transparent;
+		ft.solid_colour = ft.pattern == 0 ? fg : bg;
+
+		for (int y = 0; y < 4; y++) {
+			for (int x = 0; x < 32; x++) {
+				bool bit = (ft.pattern >> ((3 - (x & 0x3)) + (3 - y) * 4)) & 1;
+				ft.colour[y][x] = bit ? bg : fg;
+				ft.mask[y][x] = (bit && ft.transparent) ? 0 : 0xff;
+			}
+		}
+		return ft;
+	}
+
+	// fills pixels x0 to x1 - 1 of row y with the fill pattern. the span must already be clipped.
+	static void fill_span(const FillTemplate& ft, colour_t* pix, int x0, int x1, int y) {
+		int n = x1 - x0;
+		if (n <= 0 || ft.empty) {
+			return;
+		}
+		pix += x0;
+		if (ft.solid) {
+			memset(pix, ft.solid_colour, n);
+			return;
+		}
+
+		// 16 is a multiple of the pattern width, so every block starts at the same template offset
+		const colour_t* colour = ft.colour[y & 0x3] + (x0 & 0x3);
+		const uint8_t* mask = ft.mask[y & 0x3] + (x0 & 0x3);
+		int x = 0;
+
+		if (!ft.transparent) {
+			for (; x + 16 <= n; x += 16) {
+				memcpy(pix + x, colour, 16);
+			}
+			memcpy(pix + x, colour, n - x);
+			return;
+		}
+
+#if defined(TAC08_SIMD_SSE2)
+		const __m128i c = _mm_loadu_si128((const __m128i*)colour);
+		const __m128i m = _mm_loadu_si128((const __m128i*)mask);
+		for (; x + 16 <= n; x += 16) {
+			__m128i dst = _mm_loadu_si128((const __m128i*)(pix + x));
+			_mm_storeu_si128((__m128i*)(pix + x),
+			                 _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, dst)));
+		}
+#elif defined(TAC08_SIMD_NEON)
+		const uint8x16_t c = vld1q_u8(colour);
+		const uint8x16_t m = vld1q_u8(mask);
+		for (; x + 16 <= n; x += 16) {
+			vst1q_u8(pix + x, vbslq_u8(m, c, vld1q_u8(pix + x)));
+		}
+#endif
+		for (; x < n; x++) {
+			pix[x] = (colour[x & 0xf] & mask[x & 0xf]) | (pix[x] & ~mask[x & 0xf]);
+		}
+	}
+
+	// draws a single pixel with the fill pattern. the pixel must already be clipped.
+	static inline void fill_pixel(const FillTemplate& ft, colour_t* pix, int x, int y) {
+		uint8_t m = ft.mask[y & 0x3][x & 0x3];
+		*pix = (ft.colour[y & 0x3][x & 0x3] & m) | (*pix & ~m);
+	}
+
 	void hline(int x0, int x1, int y) {
 		normalise_coords(x0, x1);
 		x1++;
@@ -287,89 +960,592 @@ namespace pico_private {
 		x0 = utils::limit(x0, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
 		x1 = utils::limit(x1, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
+		fill_span(get_fill_template(), backbuffer + y * buffer_size_x, x0, x1, y);
+		mark_dirty_rows(y, y + 1);
+	}
+
+	void vline(int y0, int y1, int x) {
+		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2) {
+			return;
+		}
+
+		y0 = utils::limit(y0, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
+		y1 = utils::limit(y1, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
+
+		const FillTemplate& ft = get_fill_template();
+		colour_t* pix = backbuffer + y0 * buffer_size_x + x;
+		mark_dirty_rows(y0, y1);
+
+		for (int y = y0; y < y1; y++) {
+			fill_pixel(ft, pix, x, y);
+			pix += buffer_size_x;
+		}
+	}
+
+	void pset(int x, int y) {
+		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2 ||
+		    y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+			return;
+		}
+
+		fill_pixel(get_fill_template(), backbuffer + y * buffer_size_x + x, x, y);
+		dirty_rows[y] = 1;
+		mark_unpacked(y * buffer_size_x + x, y * buffer_size_x + x + 1);
+	}
+
+	static inline int64_t floor_div(int64_t a, int64_t b) {
+		return a >= 0 ? a / b : -((-a + b - 1) / b);
+	}
+
+	static inline int64_t ceil_div(int64_t a, int64_t b) {
+		return -floor_div(-a, b);
+	}
+
+	// steps the line from step k0 to k1 with no bounds checks. pix, x & y are the first pixel
+	// drawn, r the error term at k0.
+	template <bool X_MAJOR, bool SOLID>
+	static void line_steps(const FillTemplate& ft,
+	                       colour_t* pix,
+	                       int x,
+	                       int y,
+	                       int64_t k0,
+	                       int64_t k1,
+	                       int64_t r,
+	                       int64_t dm,
+	                       int64_t dn,
+	                       int sm,
+	                       int sn) {
+		int step_m = X_MAJOR ? sm : sm * buffer_size_x;
+		int step_n = X_MAJOR ? sn * buffer_size_x : sn;
+		for (int64_t k = k0; k <= k1; k++) {
+			if (SOLID) {
+				*pix = ft.solid_colour;
+			} else {
+				fill_pixel(ft, pix, x, y);
+			}
+			r += 2 * dn;
+			if (r >= 2 * dm) {
+				r -= 2 * dm;
+				pix += step_n;
+				(X_MAJOR ? y : x) += sn;
+			}
+			pix += step_m;
+			(X_MAJOR ? x : y) += sm;
+		}
+	}
+
+	// draws the same pixels as a bresenham walk from x0,y0 to x1,y1 through pset(). along the
+	// major axis the n-th pixel is offset on the minor axis by
+	// floor((2 * d_minor * n + d_major) / (2 * d_major)), which lets the range of steps inside the
+	// clip rectangle be found up front, liang-barsky style, before anything is drawn.
+	void line(int x0, int y0, int x1, int y1) {
+		const GraphicsState* gs = currentGraphicsState;
 
-		colour_t* pix = backbuffer + y * buffer_size_x;
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		if (y0 == y1) {
+			hline(x0, x1, y0);
+			return;
+		}
+		if (x0 == x1) {
+			normalise_coords(y0, y1);
+			vline(y0, y1 + 1, x0);
+			return;
+		}
+
+		const FillTemplate& ft = get_fill_template();
+		if (ft.empty) {
+			return;
+		}
+
+		bool x_major = abs(x1 - x0) >= abs(y1 - y0);
+		int m0 = x_major ? x0 : y0;
+		int n0 = x_major ? y0 : x0;
+		int sm = (x_major ? x1 > x0 : y1 > y0) ? 1 : -1;
+		int sn = (x_major ? y1 > y0 : x1 > x0) ? 1 : -1;
+		int64_t dm = x_major ? abs(x1 - x0) : abs(y1 - y0);
+		int64_t dn = x_major ? abs(y1 - y0) : abs(x1 - x0);
+		int m_lo = x_major ? gs->clip_x1 : gs->clip_y1;
+		int m_hi = (x_major ? gs->clip_x2 : gs->clip_y2) - 1;
+		int n_lo = x_major ? gs->clip_y1 : gs->clip_x1;
+		int n_hi = (x_major ? gs->clip_y2 : gs->clip_x2) - 1;
+
+		// steps where the major coordinate is inside the clip rectangle
+		int64_t k0 = std::max<int64_t>(0, sm > 0 ? m_lo - m0 : m0 - m_hi);
+		int64_t k1 = std::min<int64_t>(dm, sm > 0 ? m_hi - m0 : m0 - m_lo);
+
+		// and where the minor offset is between j_lo and j_hi
+		int64_t j_lo = sn > 0 ? n_lo - n0 : n0 - n_hi;
+		int64_t j_hi = sn > 0 ? n_hi - n0 : n0 - n_lo;
+		k0 = std::max(k0, ceil_div(2 * dm * j_lo - dm, 2 * dn));
+		k1 = std::min(k1, floor_div(2 * dm * j_hi + dm - 1, 2 * dn));
+		if (k0 > k1) {
+			return;
+		}
+
+		int64_t num = 2 * dn * k0 + dm;
+		int64_t j = num / (2 * dm);
+		int64_t r = num - j * 2 * dm;
+		int m = m0 + sm * int(k0);
+		int n = n0 + sn * int(j);
+		int x = x_major ? m : n;
+		int y = x_major ? n : m;
+		colour_t* pix = backbuffer + y * buffer_size_x + x;
 
-		if (pat == 0) {
-			memset(pix + x0, fg, x1 - x0);
-		} else if (pat == 0xffff && !pattr) {
-			memset(pix + x0, bg, x1 - x0);
+		int y_end = x_major ? n0 + sn * int((2 * dn * k1 + dm) / (2 * dm)) : m0 + sm * int(k1);
+		mark_dirty_rows(std::min(y, y_end), std::max(y, y_end) + 1);
+
+		if (x_major) {
+			if (ft.solid) {
+				line_steps<true, true>(ft, pix, x, y, k0, k1, r, dm, dn, sm, sn);
+			} else {
+				line_steps<true, false>(ft, pix, x, y, k0, k1, r, dm, dn, sm, sn);
+			}
 		} else {
-			if (pattr) {
-				for (int x = x0; x < x1; x++) {
-					if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
-						pix[x] = fg;
+			if (ft.solid) {
+				line_steps<false, true>(ft, pix, x, y, k0, k1, r, dm, dn, sm, sn);
+			} else {
+				line_steps<false, false>(ft, pix, x, y, k0, k1, r, dm, dn, sm, sn);
+			}
+		}
+	}
+
+	static void build_glyph_cache() {
+		GlyphCache& gc = glyph_cache;
+		for (int ch = 0x10; ch < 0x100; ch++) {
+			int index = ch < 0x80 ? ch - 0x10 : ch - 0x80;
+			int w = ch < 0x80 ? 4 : 8;
+			const colour_t* glyph =
+			    fontbuffer + ((index / 16) * 8 + (ch < 0x80 ? 0 : 56)) * 128 + (index % 16) * 8;
+
+			gc.plain[ch] = true;
+			for (int y = 0; y < 5; y++) {
+				uint8_t bits = 0;
+				for (int x = 0; x < w; x++) {
+					colour_t c = glyph[y * 128 + x];
+					if (c == 7) {
+						bits |= (1 << x);
+					} else if (c != 0) {
+						gc.plain[ch] = false;
 					}
 				}
-			} else {
-				for (int x = x0; x < x1; x++) {
-					pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? bg : fg;
+				gc.rows[ch][y] = bits;
+			}
+		}
+		gc.valid = true;
+	}
+
+	// draws a glyph from the glyph cache, pixels set in the mask are stored in colour fg.
+	static void draw_glyph(uint8_t ch, int x, int y, colour_t fg) {
+		const GraphicsState* gs = currentGraphicsState;
+		int w = ch < 0x80 ? 4 : 8;
+		if (!is_visible(x, y, w, 5)) {
+			return;
+		}
+
+		uint8_t xmask = 0xff;
+		if (x < gs->clip_x1) {
+			xmask &= 0xff << (gs->clip_x1 - x);
+		}
+		if (x + 8 > gs->clip_x2) {
+			xmask &= 0xff >> (x + 8 - gs->clip_x2);
+		}
+
+		int y0 = std::max(y, gs->clip_y1);
+		int y1 = std::min(y + 5, gs->clip_y2);
+		const uint8_t* rows = glyph_cache.rows[ch];
+		colour_t* pix = backbuffer + y0 * buffer_size_x + x;
+		mark_dirty_rows(y0, y1);
+		for (int r = y0; r < y1; r++) {
+			uint8_t bits = rows[r - y] & xmask;
+			for (int n = 0; n < w; n++) {
+				if ((bits >> n) & 1) {
+					pix[n] = fg;
 				}
 			}
+			pix += buffer_size_x;
 		}
 	}
 
-	void vline(int y0, int y1, int x) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2) {
+	// draws a glyph that is not plain through the blitter, with font colour 7 mapped to the pen
+	// colour and colour 0 transparent.
+	static void blit_glyph(uint8_t ch, int x, int y, colour_t fg) {
+		GraphicsState* gs = currentGraphicsState;
+		colour_t old = gs->palette_map[7];
+		bool oldt = gs->transparent[0];
+
+		gs->palette_map[7] = fg;
+		gs->transparent[0] = true;
+		update_palette_flags();
+
+		if (ch < 0x80) {
+			int index = ch - 0x10;
+			blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8, 4, 5);
+		} else {
+			int index = ch - 0x80;
+			blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8 + 56, 8, 5);
+		}
+
+		gs->palette_map[7] = old;
+		gs->transparent[0] = oldt;
+		update_palette_flags();
+	}
+
+	static void mark_map_cache_cell(int x, int y) {
+		for (MapCache& mc : map_caches) {
+			if (mc.used) {
+				int cx = (x - mc.cell_x) & 0x7f;
+				int cy = (y - mc.cell_y) & 0x3f;
+				if (cx < mc.cell_w && cy < mc.cell_h) {
+					mc.dirty[cy * mc.cell_w + cx] = 1;
+				}
+			}
+		}
+	}
+
+	static void mark_map_cache_sprite(int n) {
+		for (MapCache& mc : map_caches) {
+			if (mc.used) {
+				mc.dirty_sprites[n & 0xff] = true;
+				mc.any_dirty_sprites = true;
+			}
+		}
+	}
+
+	static void invalidate_map_caches() {
+		for (MapCache& mc : map_caches) {
+			if (mc.used) {
+				std::fill(mc.dirty.begin(), mc.dirty.end(), 1);
+				mc.any_dirty_sprites = false;
+			}
+		}
+	}
+
+	// finds the cache slot for the region & the current graphics state, reusing the least
+	// recently used slot if there is none.
+	static MapCache& get_map_cache(int cell_x, int cell_y, int cell_w, int cell_h, uint8_t layer) {
+		const GraphicsState* gs = currentGraphicsState;
+		MapCache* lru = &map_caches[0];
+		for (MapCache& mc : map_caches) {
+			if (mc.used && mc.cell_x == cell_x && mc.cell_y == cell_y && mc.cell_w == cell_w &&
+			    mc.cell_h == cell_h && mc.layer == layer && mc.spritebuffer == spritebuffer &&
+			    mc.spriteflags == spriteflags && mc.mapbuffer == mapbuffer &&
+			    mc.palette_map == gs->palette_map && mc.transparent == gs->transparent) {
+				mc.last_used = ++map_cache_clock;
+				return mc;
+			}
+			if (!mc.used || (lru->used && mc.last_used < lru->last_used)) {
+				lru = &mc;
+			}
+		}
+
+		MapCache& mc = *lru;
+		mc.used = true;
+		mc.last_used = ++map_cache_clock;
+		mc.cell_x = cell_x;
+		mc.cell_y = cell_y;
+		mc.cell_w = cell_w;
+		mc.cell_h = cell_h;
+		mc.layer = layer;
+		mc.spritebuffer = spritebuffer;
+		mc.spriteflags = spriteflags;
+		mc.mapbuffer = mapbuffer;
+		mc.palette_map = gs->palette_map;
+		mc.transparent = gs->transparent;
+		mc.pixels.resize(cell_w * cell_h * 64);
+		mc.mask.resize(cell_w * cell_h * 64);
+		mc.dirty.assign(cell_w * cell_h, 1);
+		mc.dirty_sprites.fill(false);
+		mc.any_dirty_sprites = false;
+		return mc;
+	}
+
+	static void render_map_cache_cell(MapCache& mc, int x, int y) {
+		int stride = mc.cell_w * 8;
+		colour_t* pix = mc.pixels.data() + y * 8 * stride + x * 8;
+		uint8_t* mask = mc.mask.data() + y * 8 * stride + x * 8;
+		uint8_t cell = mapbuffer[((mc.cell_y + y) & 0x3f) * 128 + ((mc.cell_x + x) & 0x7f)];
+
+		if (cell == 0 || (mc.layer && !(spriteflags[cell] & mc.layer))) {
+			for (int r = 0; r < 8; r++) {
+				memset(mask + r * stride, 0, 8);
+			}
 			return;
 		}
 
-		y0 = utils::limit(y0, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
-		y1 = utils::limit(y1, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
+		const colour_t* spr = spritebuffer + (cell / 16) * 8 * 128 + (cell % 16) * 8;
+		for (int r = 0; r < 8; r++) {
+			for (int c = 0; c < 8; c++) {
+				colour_t col = spr[c];
+				pix[c] = mc.palette_map[col];
+				mask[c] = mc.transparent[col] ? 0 : 0xff;
+			}
+			spr += 128;
+			pix += stride;
+			mask += stride;
+		}
+	}
 
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
+	// draws the map region from the cache, re-rendering the visible cells that have changed.
+	// scr_x & scr_y have the camera already applied.
+	static void map_cached(MapCache& mc, int scr_x, int scr_y) {
+		const GraphicsState* gs = currentGraphicsState;
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		if (mc.any_dirty_sprites) {
+			for (int y = 0; y < mc.cell_h; y++) {
+				const uint8_t* row = mapbuffer + ((mc.cell_y + y) & 0x3f) * 128;
+				for (int x = 0; x < mc.cell_w; x++) {
+					if (mc.dirty_sprites[row[(mc.cell_x + x) & 0x7f]]) {
+						mc.dirty[y * mc.cell_w + x] = 1;
+					}
+				}
+			}
+			mc.dirty_sprites.fill(false);
+			mc.any_dirty_sprites = false;
+		}
 
-		if (pattr) {
-			for (int y = y0; y < y1; y++) {
-				if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
-					pix[x] = fg;
+		int x0 = std::max(0, (gs->clip_x1 - scr_x) >> 3);
+		int x1 = std::min(mc.cell_w, (gs->clip_x2 - scr_x + 7) >> 3);
+		int y0 = std::max(0, (gs->clip_y1 - scr_y) >> 3);
+		int y1 = std::min(mc.cell_h, (gs->clip_y2 - scr_y + 7) >> 3);
+
+		for (int y = y0; y < y1; y++) {
+			uint8_t* dirty = mc.dirty.data() + y * mc.cell_w;
+			for (int x = x0; x < x1; x++) {
+				if (dirty[x]) {
+					render_map_cache_cell(mc, x, y);
+					dirty[x] = 0;
 				}
-				pix += buffer_size_x;
 			}
-		} else {
-			for (int y = y0; y < y1; y++) {
-				pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? bg : fg;
-				pix += buffer_size_x;
+		}
+
+		int stride = mc.cell_w * 8;
+		int px0 = std::max(gs->clip_x1, scr_x);
+		int px1 = std::min(gs->clip_x2, scr_x + stride);
+		int py0 = std::max(gs->clip_y1, scr_y);
+		int py1 = std::min(gs->clip_y2, scr_y + mc.cell_h * 8);
+		if (px0 < px1) {
+			mark_dirty_rows(py0, py1);
+		}
+
+		for (int y = py0; y < py1; y++) {
+			const colour_t* src = mc.pixels.data() + (y - scr_y) * stride - scr_x;
+			const uint8_t* mask = mc.mask.data() + (y - scr_y) * stride - scr_x;
+			colour_t* pix = backbuffer + y * buffer_size_x;
+			for (int x = px0; x < px1; x++) {
+				pix[x] = (src[x] & mask[x]) | (pix[x] & ~mask[x]);
 			}
 		}
 	}
 
-	void pset(int x, int y) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2 ||
-		    y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+	static void cls(colour_t p) {
+		memset(backbuffer, p, buffer_size_x * buffer_size_y);
+		mark_dirty_rows(0, buffer_size_y);
+	}
+
+	static void rect(int x0, int y0, int x1, int y1) {
+		hline(x0, x1, y0);
+		hline(x0, x1, y1);
+		vline(y0, y1, x0);
+		vline(y0, y1, x1);
+	}
+
+	static void rectfill(int x0, int y0, int x1, int y1) {
+		clip_rect(x0, y0, x1, y1);
+		const FillTemplate& ft = get_fill_template();
+		colour_t* pix = backbuffer + y0 * buffer_size_x;
+		mark_dirty_rows(y0, y1 + 1);
+
+		for (int y = y0; y <= y1; y++) {
+			fill_span(ft, pix, x0, x1 + 1, y);
+			pix += buffer_size_x;
+		}
+	}
+
+	static void circ(int xm, int ym, int r) {
+		if (r >= 0) {
+			int x = -r, y = 0, err = 2 - 2 * r; /* II. Quadrant */
+			do {
+				pset(xm - x, ym + y); /*   I. Quadrant */
+				pset(xm - y, ym - x); /*  II. Quadrant */
+				pset(xm + x, ym - y); /* III. Quadrant */
+				pset(xm + y, ym + x); /*  IV. Quadrant */
+				r = err;
+				if (r > x)
+					err += ++x * 2 + 1; /* e_xy+e_x > 0 */
+				if (r <= y)
+					err += ++y * 2 + 1; /* e_xy+e_y < 0 */
+			} while (x < 0);
+		}
+	}
+
+	static void circfill(int xm, int ym, int r) {
+		if (r == 0) {
+			pset(xm, ym);
+		} else if (r == 1) {
+			pset(xm, ym - 1);
+			hline(xm - 1, xm + 1, ym);
+			pset(xm, ym + 1);
+		} else if (r > 0) {
+			int x = -r, y = 0, err = 2 - 2 * r;
+			do {
+				hline(xm - x, xm + x, ym + y);
+				hline(xm - x, xm + x, ym - y);
+				r = err;
+				if (r > x)
+					err += ++x * 2 + 1;
+				if (r <= y)
+					err += ++y * 2 + 1;
+			} while (x < 0);
+		}
+	}
+
+	static void map(int cell_x, int cell_y, int scr_x, int scr_y, int cell_w, int cell_h, uint8_t layer) {
+		const GraphicsState* gs = currentGraphicsState;
+
+		if (map_cache_enabled && cell_w > 0 && cell_w <= 128 && cell_h > 0 && cell_h <= 64) {
+			MapCache& mc = get_map_cache(cell_x & 0x7f, cell_y & 0x3f, cell_w, cell_h, layer);
+			map_cached(mc, scr_x, scr_y);
 			return;
 		}
 
-		colour_t* pix = backbuffer + y * buffer_size_x + x;
-		uint16_t pat = currentGraphicsState->pattern;
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		bool pattr = currentGraphicsState->pattern_transparent;
-
-		if (pat == 0) {
-			*pix = fg;
-		} else if (pat == 0xffff && !pattr) {
-			*pix = bg;
-		} else {
-			if (pattr) {
-				if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
-					*pix = fg;
+		// only walk the cells that overlap the clip rectangle. a cell at x is visible when
+		// scr_x + x * 8 + 8 > clip_x1 and scr_x + x * 8 < clip_x2 (>> 3 rounds down for
+		// negative values too).
+		int x0 = std::max(0, (gs->clip_x1 - scr_x) >> 3);
+		int x1 = std::min(cell_w, (gs->clip_x2 - scr_x + 7) >> 3);
+		int y0 = std::max(0, (gs->clip_y1 - scr_y) >> 3);
+		int y1 = std::min(cell_h, (gs->clip_y2 - scr_y + 7) >> 3);
+
+		for (int y = y0; y < y1; y++) {
+			const uint8_t* row = mapbuffer + ((cell_y + y) & 0x3f) * 128;
+			int sy = scr_y + y * 8;
+
+			for (int x = x0; x < x1; x++) {
+				uint8_t cell = row[(cell_x + x) & 0x7f];
+				if (cell == 0 || (layer && !(spriteflags[cell] & layer))) {
+					continue;
 				}
-			} else {
-				*pix = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? bg : fg;
+				if (get_sprite_opacity(cell).empty) {
+					continue;
+				}
+				blitter(spritebuffer, scr_x + x * 8, sy, (cell % 16) * 8, (cell / 16) * 8, 8, 8,
+				        false, false);
 			}
 		}
 	}
 
+	static uint32_t record_state() {
+		const GraphicsState* gs = currentGraphicsState;
+
+		if (draw_palettes.empty() || recorded_palette_state != gs ||
+		    recorded_palette_generation != palette_generation) {
+			draw_palettes.push_back(DrawPalette{gs->palette_map, gs->transparent});
+			recorded_palette_state = gs;
+			recorded_palette_generation = palette_generation;
+		}
+
+		DrawState ds = {gs->fg,      gs->bg,      gs->pattern, gs->pattern_transparent,
+		                gs->clip_x1, gs->clip_y1, gs->clip_x2, gs->clip_y2,
+		                uint32_t(draw_palettes.size() - 1)};
+		if (draw_states.empty() || !(draw_states.back() == ds)) {
+			draw_states.push_back(ds);
+		}
+		return uint32_t(draw_states.size() - 1);
+	}
+
+	static void record(DrawOp op,
+	                   std::initializer_list<int> args,
+	                   bool flip_x = false,
+	                   bool flip_y = false,
+	                   uint8_t layer = 0) {
+		DrawCommand cmd;
+		cmd.op = op;
+		cmd.flip_x = flip_x;
+		cmd.flip_y = flip_y;
+		cmd.layer = layer;
+		cmd.state = record_state();
+		std::copy(args.begin(), args.end(), cmd.args);
+		draw_commands.push_back(cmd);
+	}
+
+	static void clear_draw_commands() {
+		draw_commands.clear();
+		draw_states.clear();
+		draw_palettes.clear();
+		recorded_palette_state = nullptr;
+	}
+
+	// runs the recorded commands against the draw state each was recorded with.
+	static void flush_draw_commands() {
+		if (draw_commands.empty()) {
+			return;
+		}
+
+		GraphicsState* saved = currentGraphicsState;
+		GraphicsState replay;
+		currentGraphicsState = &replay;
+		uint32_t state = UINT32_MAX;
+		uint32_t palette = UINT32_MAX;
+
+		for (const DrawCommand& cmd : draw_commands) {
+			if (cmd.state != state) {
+				state = cmd.state;
+				const DrawState& ds = draw_states[state];
+				replay.fg = ds.fg;
+				replay.bg = ds.bg;
+				replay.pattern = ds.pattern;
+				replay.pattern_transparent = ds.pattern_transparent;
+				replay.clip_x1 = ds.clip_x1;
+				replay.clip_y1 = ds.clip_y1;
+				replay.clip_x2 = ds.clip_x2;
+				replay.clip_y2 = ds.clip_y2;
+				if (ds.palette != palette) {
+					palette = ds.palette;
+					replay.palette_map = draw_palettes[palette].palette_map;
+					replay.transparent = draw_palettes[palette].transparent;
+					update_palette_flags();
+				}
+			}
+
+			const int32_t* a = cmd.args;
+			switch (cmd.op) {
+				case DrawOp::Cls:
+					cls(a[0]);
+					break;
+				case DrawOp::Pset:
+					pset(a[0], a[1]);
+					break;
+				case DrawOp::Rect:
+					rect(a[0], a[1], a[2], a[3]);
+					break;
+				case DrawOp::RectFill:
+					rectfill(a[0], a[1], a[2], a[3]);
+					break;
+				case DrawOp::Circ:
+					circ(a[0], a[1], a[2]);
+					break;
+				case DrawOp::CircFill:
+					circfill(a[0], a[1], a[2]);
+					break;
+				case DrawOp::Line:
+					line(a[0], a[1], a[2], a[3]);
+					break;
+				case DrawOp::Blit:
+					blitter(spritebuffer, a[0], a[1], a[2], a[3], a[4], a[5], cmd.flip_x, cmd.flip_y);
+					break;
+				case DrawOp::StretchBlit:
+					stretch_blitter(spritebuffer, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+					                cmd.flip_x, cmd.flip_y);
+					break;
+				case DrawOp::Map:
+					map(a[0], a[1], a[2], a[3], a[4], a[5], cmd.layer);
+					break;
+			}
+		}
+
+		currentGraphicsState = saved;
+		clear_draw_commands();
+	}
+
 	void apply_camera(int& x, int& y) {
 		x = x - currentGraphicsState->camera_x;
 		y = y - currentGraphicsState->camera_y;
@@ -405,7 +1581,11 @@ namespace pico_api {
 
 	void cls(colour_t c) {
 		colour_t p = currentGraphicsState->palette_map[c];
-		memset(backbuffer, p, buffer_size_x * buffer_size_y);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Cls, {p});
+		} else {
+			pico_private::cls(p);
+		}
 
 		currentGraphicsState->text_x = 0;
 		currentGraphicsState->text_y = 0;
@@ -424,7 +1604,9 @@ namespace pico_api {
 	}
 
 	void fset(int n, uint8_t val) {
+		pico_private::flush_draw_commands();
 		spriteflags[n & 0xff] = val;
+		pico_private::mark_map_cache_sprite(n);
 	}
 
 	void fset(int n, int bit, bool val) {
@@ -445,24 +1627,41 @@ namespace pico_api {
 	void spr(int n, int x, int y, int w, int h, bool flip_x, bool flip_y) {
 		pico_private::apply_camera(x, y);
 
+		if (w == 1 && h == 1 && n >= 0 && n < 256 &&
+		    pico_private::get_sprite_opacity(n).empty) {
+			return;
+		}
+
 		int spr_x = (n % 16) * 8;
 		int spr_y = (n / 16) * 8;
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Blit, {x, y, spr_x, spr_y, w * 8, h * 8}, flip_x, flip_y);
+			return;
+		}
 		pico_private::blitter(spritebuffer, x, y, spr_x, spr_y, w * 8, h * 8, flip_x, flip_y);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy) {
 		pico_private::apply_camera(dx, dy);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Blit, {dx, dy, sx, sy, sw, sh});
+			return;
+		}
 		pico_private::blitter(spritebuffer, dx, dy, sx, sy, sw, sh);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh) {
-		pico_private::apply_camera(dx, dy);
-		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh);
+		sspr(sx, sy, sw, sh, dx, dy, dw, dh, false, false);
 	}
 
 	void
 	sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flip_x, bool flip_y) {
 		pico_private::apply_camera(dx, dy);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::StretchBlit, {sx, sy, sw, sh, dx, dy, dw, dh}, flip_x,
+			                     flip_y);
+			return;
+		}
 		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh, flip_x, flip_y);
 	}
 
@@ -477,9 +1676,11 @@ namespace pico_api {
 	}
 
 	void sset(int x, int y, colour_t c) {
+		pico_private::flush_draw_commands();
 		y &= 0x7f;
 		x &= 0x7f;
 		spritebuffer[y * 128 + x] = c;
+		pico_control::invalidate_sprite_cache(x, y);
 	}
 
 	void pset(int x, int y) {
@@ -492,10 +1693,15 @@ namespace pico_api {
 		}
 		color(c);
 		pico_private::apply_camera(x, y);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Pset, {x, y});
+			return;
+		}
 		pico_private::pset(x, y);
 	}
 
 	colour_t pget(int x, int y) {
+		pico_private::flush_draw_commands();
 		pico_private::apply_camera(x, y);
 		x &= 0x7f;
 		y &= 0x7f;
@@ -515,10 +1721,11 @@ namespace pico_api {
 		color(c);
 		pico_private::normalise_coords(x0, x1);
 		pico_private::normalise_coords(y0, y1);
-		pico_private::hline(x0, x1, y0);
-		pico_private::hline(x0, x1, y1);
-		pico_private::vline(y0, y1, x0);
-		pico_private::vline(y0, y1, x1);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Rect, {x0, y0, x1, y1});
+			return;
+		}
+		pico_private::rect(x0, y0, x1, y1);
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1) {
@@ -526,7 +1733,6 @@ namespace pico_api {
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1, uint16_t c, uint16_t p) {
-		using namespace pico_private;
 		if (currentGraphicsState->pattern_with_colour) {
 			fillp(p, false);
 		}
@@ -536,32 +1742,11 @@ namespace pico_api {
 		color(c);
 		pico_private::normalise_coords(x0, x1);
 		pico_private::normalise_coords(y0, y1);
-
-		pico_private::clip_rect(x0, y0, x1, y1);
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
-		colour_t p1 = currentGraphicsState->palette_map[fgcolor(c)];
-		colour_t p2 = currentGraphicsState->palette_map[bgcolor(c)];
-
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
-
-		if (pattr) {
-			for (int y = y0; y <= y1; y++) {
-				for (int x = x0; x <= x1; x++) {
-					if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
-						pix[x] = p1;
-					}
-				}
-				pix += buffer_size_x;
-			}
-		} else {
-			for (int y = y0; y <= y1; y++) {
-				for (int x = x0; x <= x1; x++) {
-					pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? p2 : p1;
-				}
-				pix += buffer_size_x;
-			}
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::RectFill, {x0, y0, x1, y1});
+			return;
 		}
+		pico_private::rectfill(x0, y0, x1, y1);
 	}
 
 	void circ(int x, int y, int r) {
@@ -574,20 +1759,11 @@ namespace pico_api {
 		}
 		pico_private::apply_camera(xm, ym);
 		color(c);
-		if (r >= 0) {
-			int x = -r, y = 0, err = 2 - 2 * r; /* II. Quadrant */
-			do {
-				pico_private::pset(xm - x, ym + y); /*   I. Quadrant */
-				pico_private::pset(xm - y, ym - x); /*  II. Quadrant */
-				pico_private::pset(xm + x, ym - y); /* III. Quadrant */
-				pico_private::pset(xm + y, ym + x); /*  IV. Quadrant */
-				r = err;
-				if (r > x)
-					err += ++x * 2 + 1; /* e_xy+e_x > 0 */
-				if (r <= y)
-					err += ++y * 2 + 1; /* e_xy+e_y < 0 */
-			} while (x < 0);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Circ, {xm, ym, r});
+			return;
 		}
+		pico_private::circ(xm, ym, r);
 	}
 
 	void circfill(int x, int y, int r) {
@@ -600,24 +1776,11 @@ namespace pico_api {
 		}
 		pico_private::apply_camera(xm, ym);
 		color(c);
-		if (r == 0) {
-			pico_private::pset(xm, ym);
-		} else if (r == 1) {
-			pico_private::pset(xm, ym - 1);
-			pico_private::hline(xm - 1, xm + 1, ym);
-			pico_private::pset(xm, ym + 1);
-		} else if (r > 0) {
-			int x = -r, y = 0, err = 2 - 2 * r;
-			do {
-				pico_private::hline(xm - x, xm + x, ym + y);
-				pico_private::hline(xm - x, xm + x, ym - y);
-				r = err;
-				if (r > x)
-					err += ++x * 2 + 1;
-				if (r <= y)
-					err += ++y * 2 + 1;
-			} while (x < 0);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::CircFill, {xm, ym, r});
+			return;
 		}
+		pico_private::circfill(xm, ym, r);
 	}
 
 	void line(int x, int y) {
@@ -638,24 +1801,11 @@ namespace pico_api {
 		pico_private::apply_camera(x0, y0);
 		pico_private::apply_camera(x1, y1);
 		color(c);
-		int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-		int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-		int err = dx + dy, e2; /* error value e_xy */
-
-		for (;;) { /* loop */
-			pico_private::pset(x0, y0);
-			if (x0 == x1 && y0 == y1)
-				break;
-			e2 = 2 * err;
-			if (e2 >= dy) {
-				err += dy;
-				x0 += sx;
-			} /* e_xy+e_x > 0 */
-			if (e2 <= dx) {
-				err += dx;
-				y0 += sy;
-			} /* e_xy+e_y < 0 */
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Line, {x0, y0, x1, y1});
+			return;
 		}
+		pico_private::line(x0, y0, x1, y1);
 	}
 
 	void map(int cell_x, int cell_y) {
@@ -671,14 +1821,13 @@ namespace pico_api {
 	}
 
 	void map(int cell_x, int cell_y, int scr_x, int scr_y, int cell_w, int cell_h, uint8_t layer) {
-		for (int y = 0; y < cell_h; y++) {
-			for (int x = 0; x < cell_w; x++) {
-				uint8_t cell = mget(cell_x + x, cell_y + y);
-				if (cell && ((layer == 0) || (fget(cell) & layer))) {
-					spr(cell, scr_x + x * 8, scr_y + y * 8);
-				}
-			}
+		pico_private::apply_camera(scr_x, scr_y);
+		if (draw_buffer_enabled) {
+			pico_private::record(DrawOp::Map, {cell_x, cell_y, scr_x, scr_y, cell_w, cell_h}, false,
+			                     false, layer);
+			return;
 		}
+		pico_private::map(cell_x, cell_y, scr_x, scr_y, cell_w, cell_h, layer);
 	}
 
 	uint8_t mget(int x, int y) {
@@ -688,9 +1837,11 @@ namespace pico_api {
 	}
 
 	void mset(int x, int y, uint8_t v) {
+		pico_private::flush_draw_commands();
 		x &= 0x7f;
 		y &= 0x3f;
 		mapbuffer[y * 128 + x] = v;
+		pico_private::mark_map_cache_cell(x, y);
 	}
 
 	void pal(colour_t c0, colour_t c1, int p) {
@@ -701,6 +1852,7 @@ namespace pico_api {
 			screen_palette[c0] = c1;
 		} else {
 			currentGraphicsState->palette_map[c0 & 0xf] = c1 & 0xf;
+			pico_private::update_palette_flags();
 		}
 	}
 
@@ -715,6 +1867,7 @@ namespace pico_api {
 
 	void palt(colour_t col, bool t) {
 		currentGraphicsState->transparent[col] = t;
+		pico_private::update_palette_flags();
 	}
 
 	void palt() {
@@ -741,28 +1894,28 @@ namespace pico_api {
 	}
 
 	int print(std::string str, int x, int y, uint16_t c) {
+		pico_private::flush_draw_commands();
 		pico_private::apply_camera(x, y);
 		color(c);
 
-		colour_t old = currentGraphicsState->palette_map[7];
-		bool oldt = currentGraphicsState->transparent[0];
-
-		currentGraphicsState->palette_map[7] = currentGraphicsState->fg;
-		currentGraphicsState->transparent[0] = true;
+		if (!glyph_cache.valid) {
+			pico_private::build_glyph_cache();
+		}
+		colour_t fg = currentGraphicsState->fg;
+		// the pen colour replaces font colour 7, which can still be made transparent with palt
+		bool draw = !currentGraphicsState->transparent[7];
 
 		currentGraphicsState->text_x = x;
 
 		for (size_t n = 0; n < str.length(); n++) {
 			uint8_t ch = str[n];
-			if (ch >= 0x10 && ch < 0x80) {
-				int index = ch - 0x10;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8, 4, 5);
-				x += 4;
-			} else if (ch >= 0x80) {
-				int index = ch - 0x80;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8 + 56, 8,
-				                      5);
-				x += 8;
+			if (ch >= 0x10) {
+				if (!glyph_cache.plain[ch]) {
+					pico_private::blit_glyph(ch, x, y, fg);
+				} else if (draw) {
+					pico_private::draw_glyph(ch, x, y, fg);
+				}
+				x += ch < 0x80 ? 4 : 8;
 			} else if (ch == '\n') {
 				x = currentGraphicsState->text_x;
 				y += 6;
@@ -772,9 +1925,6 @@ namespace pico_api {
 		currentGraphicsState->text_x = 0;
 		currentGraphicsState->text_y = y + 6;
 
-		currentGraphicsState->palette_map[7] = old;
-		currentGraphicsState->transparent[0] = oldt;
-
 		currentGraphicsState->fg = c & 0xf;
 		return x;
 	}
@@ -996,6 +2146,20 @@ namespace pico_apix {
 		}
 	}
 
+	void drawbuffer(bool enable) {
+		pico_private::flush_draw_commands();
+		draw_buffer_enabled = enable;
+	}
+
+	void mapcache(bool enable) {
+		map_cache_enabled = enable;
+		if (!enable) {
+			for (MapCache& mc : map_caches) {
+				mc = MapCache();
+			}
+		}
+	}
+
 	std::pair<int, int> printx(std::string str, int x, int y, uint16_t c) {
 		for (size_t n = 0; n < str.length(); n++) {
 			if (str[n] == '\n') {
@@ -1009,33 +2173,96 @@ namespace pico_apix {
 namespace pico_control {
 
 	void gfx_init() {
+		pico_private::clear_draw_commands();
+		draw_buffer_enabled = false;
+		pico_apix::mapcache(false);
 		extendedGraphicsStates.clear();
 		pico_apix::gfxstate(0);
 	}
 
 	void set_backbuffer(pico_api::colour_t* buffer, int width, int height, int stride) {
+		pico_private::flush_draw_commands();
 		backbuffer = buffer;
 		buffer_size_x = width;
 		buffer_size_y = height;
 		buffer_stride = stride;
 		currentGraphicsState->max_clip_x = width;
 		currentGraphicsState->max_clip_y = height;
+		mark_screen_dirty(0, height);
+	}
+
+	void mark_screen_dirty(int y0, int y1) {
+		y0 = std::max(y0, 0);
+		y1 = std::min(y1, buffer_size_y);
+		if (y0 < y1) {
+			memset(dirty_rows.data() + y0, 1, y1 - y0);
+		}
+	}
+
+	void get_unpacked_pixels(int& begin, int& end) {
+		begin = unpacked_begin;
+		end = unpacked_end;
+	}
+
+	void clear_unpacked_pixels() {
+		unpacked_begin = 0;
+		unpacked_end = 0;
+	}
+
+	const uint8_t* get_dirty_rows() {
+		return dirty_rows.data();
+	}
+
+	void clear_dirty_rows() {
+		dirty_rows.fill(0);
 	}
 
 	void set_spritebuffer(pico_api::colour_t* buffer) {
+		pico_private::flush_draw_commands();
 		spritebuffer = buffer;
+		invalidate_sprite_cache();
+	}
+
+	void invalidate_sprite_cache() {
+		pico_private::flush_draw_commands();
+		pico_private::invalidate_sprite_opacity();
+		pico_private::invalidate_map_caches();
+	}
+
+	void invalidate_sprite_cache(int x, int y) {
+		sprite_opacity[(y >> 3) * 16 + (x >> 3)].generation = 0;
+		pico_private::mark_map_cache_sprite((y >> 3) * 16 + (x >> 3));
+	}
+
+	void invalidate_map_cache(int x, int y) {
+		pico_private::mark_map_cache_cell(x, y);
+	}
+
+	void invalidate_sprite_flags(int n) {
+		pico_private::mark_map_cache_sprite(n);
 	}
 
 	void set_spriteflags(uint8_t* buffer) {
+		pico_private::flush_draw_commands();
 		spriteflags = buffer;
 	}
 
 	void set_mapbuffer(uint8_t* buffer) {
+		pico_private::flush_draw_commands();
 		mapbuffer = buffer;
 	}
 
 	void set_fontbuffer(pico_api::colour_t* buffer) {
 		fontbuffer = buffer;
+		invalidate_font_cache();
+	}
+
+	void invalidate_font_cache() {
+		glyph_cache.valid = false;
+	}
+
+	void flush_draw_commands() {
+		pico_private::flush_draw_commands();
 	}
 
 }  // namespace pico_control
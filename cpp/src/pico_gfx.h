@@ -2,6 +2,7 @@
 #define PICO_GFX_H
 
 #include <stdint.h>
+#include <array>
 #include <string>
 #include <utility>
 
@@ -87,16 +88,38 @@ namespace pico_api {
 namespace pico_apix {
 	void xpal(bool enable);
 	void gfxstate(int index);
+	void drawbuffer(bool enable);
+	void mapcache(bool enable);
 	std::pair<int, int> printx(std::string str, int x, int y, uint16_t c);
 }  // namespace pico_apix
 
 namespace pico_control {
 	void gfx_init();
 	void set_backbuffer(pico_api::colour_t* buffer, int width, int height, int stride);
+	// tracks the rows of the backbuffer changed since the last present. must be called with the
+	// rows y0 to y1 - 1 when the backbuffer is modified directly, through the screen memory.
+	void mark_screen_dirty(int y0, int y1);
+	const uint8_t* get_dirty_rows();
+	void clear_dirty_rows();
+	// the pixels drawn to since clear_unpacked_pixels(), as a range of offsets into the
+	// backbuffer. the core keeps the screen memory packed 4 bits per pixel and re-packs these
+	// before the memory is read. begin == end when nothing was drawn.
+	void get_unpacked_pixels(int& begin, int& end);
+	void clear_unpacked_pixels();
 	void set_spritebuffer(pico_api::colour_t* buffer);
+	// must be called when the current sprite sheet is modified directly
+	void invalidate_sprite_cache();
+	void invalidate_sprite_cache(int x, int y);
+	// must be called when the map or sprite flags are modified directly
+	void invalidate_map_cache(int x, int y);
+	void invalidate_sprite_flags(int n);
 	void set_spriteflags(uint8_t* buffer);
 	void set_mapbuffer(uint8_t* buffer);
 	void set_fontbuffer(pico_api::colour_t* buffer);
+	// must be called when the current font sheet is modified directly
+	void invalidate_font_cache();
+	// runs any draw commands recorded while the draw buffer is enabled
+	void flush_draw_commands();
 }  // namespace pico_control
 
 #endif /* PICO_GFX_H */
@@ -3,34 +3,249 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "pico_memory.h"
+#include "simd.h"
 
 namespace pico_ram {
 
 	RAM::RAM() {
-		m_pages.fill(nullptr);
+		m_pages.fill(Page());
+	}
+
+	void RAM::mapLinear(uint16_t address, uint16_t size, uint8_t* data) {
+		for (int32_t i = 0; i < size / PAGE_SIZE; i++) {
+			Page& p = m_pages[(address >> 8) + i];
+			p = Page();
+			p.kind = PAGE_LINEAR;
+			p.data = data + i * PAGE_SIZE;
+		}
+	}
+
+	void RAM::mapNibbles(uint16_t address, uint16_t size, uint8_t* data) {
+		for (int32_t i = 0; i < size / PAGE_SIZE; i++) {
+			Page& p = m_pages[(address >> 8) + i];
+			p = Page();
+			p.kind = PAGE_NIBBLE;
+			p.data = data + i * PAGE_SIZE * 2;
+		}
 	}
 
-	void RAM::addMemoryArea(IMemoryArea* area) {
-		for (int32_t i = 0; i < (int32_t)(area->size() / 256); i++) {
-			m_pages[(area->address() >> 8) + i] = area;
+	void RAM::mapDual(uint16_t address, uint16_t size, uint8_t* data, uint8_t* nibbles) {
+		for (int32_t i = 0; i < size / PAGE_SIZE; i++) {
+			Page& p = m_pages[(address >> 8) + i];
+			p = Page();
+			p.kind = PAGE_DUAL;
+			p.data = data + i * PAGE_SIZE;
+			p.nibbles = nibbles + i * PAGE_SIZE * 2;
 		}
 	}
 
-	uint8_t RAM::peek(uint16_t addr) {
-		auto area = m_pages[addr >> 8];
-		if (area == nullptr) {
-			return 0;
+	void RAM::mapIO(uint16_t address, uint16_t size, io_peek_t peek, io_poke_t poke) {
+		for (int32_t i = 0; i < size / PAGE_SIZE; i++) {
+			Page& p = m_pages[(address >> 8) + i];
+			p = Page();
+			p.kind = PAGE_IO;
+			p.io_peek = peek;
+			p.io_poke = poke;
 		}
-		return area->peek(addr - area->address());
 	}
 
-	void RAM::poke(uint16_t addr, uint8_t val) {
-		auto area = m_pages[addr >> 8];
+	void RAM::mapConstant(uint16_t address, uint16_t size, uint8_t value) {
+		for (int32_t i = 0; i < size / PAGE_SIZE; i++) {
+			Page& p = m_pages[(address >> 8) + i];
+			p = Page();
+			p.kind = PAGE_CONSTANT;
+			p.value = value;
+		}
+	}
 
-		if (area) {
-			area->poke(addr - area->address(), val);
+	// the vector kernels convert 32 bytes to or from 64 pixels per iteration, the scalar loops
+	// do the rest
+	void pack_nibbles(uint8_t* out, const uint8_t* pixels, size_t n) {
+		size_t i = 0;
+#if defined(TAC08_SIMD_SSE2)
+		// each 16 bit lane holds an even and an odd pixel, shifting the lane right by 4 puts the
+		// odd pixel in the high nibble of the low byte
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		const __m128i low_byte = _mm_set1_epi16(0x00ff);
+		for (; i + 32 <= n; i += 32) {
+			const uint8_t* p = pixels + i * 2;
+			__m128i r[4];
+			for (int k = 0; k < 4; k++) {
+				__m128i w = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + k * 16)), nibble);
+				r[k] = _mm_and_si128(_mm_or_si128(w, _mm_srli_epi16(w, 4)), low_byte);
+			}
+			_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(r[0], r[1]));
+			_mm_storeu_si128((__m128i*)(out + i + 16), _mm_packus_epi16(r[2], r[3]));
+		}
+#elif defined(TAC08_SIMD_NEON)
+		const uint8x16_t nibble = vdupq_n_u8(0x0f);
+		for (; i + 32 <= n; i += 32) {
+			for (int k = 0; k < 2; k++) {
+				uint8x16x2_t p = vld2q_u8(pixels + (i + k * 16) * 2);
+				uint8x16_t v = vorrq_u8(vandq_u8(p.val[0], nibble), vshlq_n_u8(p.val[1], 4));
+				vst1q_u8(out + i + k * 16, v);
+			}
 		}
+#endif
+		for (; i < n; i++) {
+			out[i] = (pixels[i * 2] & 0xf) | ((pixels[i * 2 + 1] & 0xf) << 4);
+		}
+	}
+
+	void unpack_nibbles(uint8_t* pixels, const uint8_t* in, size_t n) {
+		size_t i = 0;
+#if defined(TAC08_SIMD_SSE2)
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		for (; i + 32 <= n; i += 32) {
+			uint8_t* p = pixels + i * 2;
+			for (int k = 0; k < 2; k++) {
+				__m128i b = _mm_loadu_si128((const __m128i*)(in + i + k * 16));
+				__m128i lo = _mm_and_si128(b, nibble);
+				__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble);
+				_mm_storeu_si128((__m128i*)(p + k * 32), _mm_unpacklo_epi8(lo, hi));
+				_mm_storeu_si128((__m128i*)(p + k * 32 + 16), _mm_unpackhi_epi8(lo, hi));
+			}
+		}
+#elif defined(TAC08_SIMD_NEON)
+		const uint8x16_t nibble = vdupq_n_u8(0x0f);
+		for (; i + 32 <= n; i += 32) {
+			for (int k = 0; k < 2; k++) {
+				uint8x16_t b = vld1q_u8(in + i + k * 16);
+				uint8x16x2_t p;
+				p.val[0] = vandq_u8(b, nibble);
+				p.val[1] = vshrq_n_u8(b, 4);
+				vst2q_u8(pixels + (i + k * 16) * 2, p);
+			}
+		}
+#endif
+		for (; i < n; i++) {
+			pixels[i * 2] = in[i] & 0xf;
+			pixels[i * 2 + 1] = in[i] >> 4;
+		}
+	}
+
+	static void fill_nibbles(uint8_t* pixels, uint8_t val, size_t n) {
+		if ((val & 0xf) == (val >> 4)) {
+			memset(pixels, val & 0xf, n * 2);
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				pixels[i * 2] = val & 0xf;
+				pixels[i * 2 + 1] = val >> 4;
+			}
+		}
+	}
+
+	void RAM::read(uint16_t addr, uint8_t* out, uint32_t len) const {
+		while (len) {
+			const Page& p = page(addr);
+			uint32_t offset = addr & 0xff;
+			uint32_t n = std::min<uint32_t>(len, PAGE_SIZE - offset);
+			switch (p.kind) {
+				case PAGE_LINEAR:
+				case PAGE_DUAL:
+					memcpy(out, p.data + offset, n);
+					break;
+				case PAGE_NIBBLE:
+					pack_nibbles(out, p.data + offset * 2, n);
+					break;
+				case PAGE_IO:
+					for (uint32_t i = 0; i < n; i++) {
+						out[i] = p.io_peek(uint16_t(addr + i));
+					}
+					break;
+				case PAGE_CONSTANT:
+					memset(out, p.value, n);
+					break;
+			}
+			addr += n;
+			out += n;
+			len -= n;
+		}
+	}
+
+	void RAM::write(uint16_t addr, const uint8_t* in, uint32_t len) {
+		while (len) {
+			const Page& p = page(addr);
+			uint32_t offset = addr & 0xff;
+			uint32_t n = std::min<uint32_t>(len, PAGE_SIZE - offset);
+			switch (p.kind) {
+				case PAGE_LINEAR:
+					memmove(p.data + offset, in, n);
+					break;
+				case PAGE_NIBBLE:
+					unpack_nibbles(p.data + offset * 2, in, n);
+					break;
+				case PAGE_DUAL:
+					memmove(p.data + offset, in, n);
+					unpack_nibbles(p.nibbles + offset * 2, p.data + offset, n);
+					break;
+				case PAGE_IO:
+					for (uint32_t i = 0; i < n; i++) {
+						p.io_poke(uint16_t(addr + i), in[i]);
+					}
+					break;
+				case PAGE_CONSTANT:
+					break;
+			}
+			addr += n;
+			in += n;
+			len -= n;
+		}
+	}
+
+	void RAM::fill(uint16_t addr, uint8_t val, uint32_t len) {
+		while (len) {
+			const Page& p = page(addr);
+			uint32_t offset = addr & 0xff;
+			uint32_t n = std::min<uint32_t>(len, PAGE_SIZE - offset);
+			switch (p.kind) {
+				case PAGE_LINEAR:
+					memset(p.data + offset, val, n);
+					break;
+				case PAGE_NIBBLE:
+					fill_nibbles(p.data + offset * 2, val, n);
+					break;
+				case PAGE_DUAL:
+					memset(p.data + offset, val, n);
+					fill_nibbles(p.nibbles + offset * 2, val, n);
+					break;
+				case PAGE_IO:
+					for (uint32_t i = 0; i < n; i++) {
+						p.io_poke(uint16_t(addr + i), val);
+					}
+					break;
+				case PAGE_CONSTANT:
+					break;
+			}
+			addr += n;
+			len -= n;
+		}
+	}
+
+	uint8_t* RAM::contiguous(uint16_t addr, uint32_t len, bool dual) const {
+		const Page& first = page(addr);
+		if (len == 0) {
+			return nullptr;
+		}
+		for (uint32_t i = addr >> 8; i <= (addr + len - 1) >> 8; i++) {
+			const Page& p = m_pages[i];
+			if (!(p.kind == PAGE_LINEAR || (dual && p.kind == PAGE_DUAL)) ||
+			    p.data != first.data + (i - (addr >> 8)) * PAGE_SIZE) {
+				return nullptr;
+			}
+		}
+		return first.data + (addr & 0xff);
+	}
+
+	uint8_t* RAM::linear(uint16_t addr, uint32_t len) const {
+		return contiguous(addr, len, false);
+	}
+
+	const uint8_t* RAM::readable(uint16_t addr, uint32_t len) const {
+		return contiguous(addr, len, true);
 	}
 
 	void RAM::dump(uint16_t from, uint16_t len) {
@@ -1,6 +1,7 @@
 #ifndef PICO_MEMORY_H
 #define PICO_MEMORY_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <array>
 
@@ -23,151 +24,129 @@ namespace pico_ram {
 	const uint16_t MEM_SCRATCH_SIZE = 0x1b00;
 	const uint16_t MEM_CART_DATA_ADDR = 0x5e00;
 	const uint16_t MEM_CART_DATA_SIZE = 0x0100;
+	const uint16_t MEM_DRAW_STATE_ADDR = 0x5f00;
+	const uint16_t MEM_DRAW_STATE_SIZE = 0x0100;
 	const uint16_t MEM_SCREEN_ADDR = 0x6000;
 	const uint16_t MEM_SCREEN_SIZE = 0x2000;
 
-	struct IMemoryArea {
-	   public:
-		virtual uint16_t address() const = 0;
-		virtual uint16_t size() const = 0;
-		virtual uint8_t peek(uint16_t addr) = 0;
-		virtual void poke(uint16_t addr, uint8_t val) = 0;
-	};
-
-	struct MemoryArea : public IMemoryArea {
-	   protected:
-		uint8_t* m_data;
-		uint16_t m_address;
-		uint16_t m_size;
-
-	   public:
-		MemoryArea(uint8_t* data, uint16_t address, uint16_t size)
-		    : m_data(data), m_address(address), m_size(size) {
-		}
-
-		void setData(uint8_t* data) {
-			m_data = data;
-		}
-
-		virtual uint16_t address() const {
-			return m_address;
-		}
-		virtual uint16_t size() const {
-			return m_size;
-		}
-
-		virtual uint8_t peek(uint16_t addr) = 0;
-		virtual void poke(uint16_t addr, uint8_t val) = 0;
-	};  // namespace pico_ram
-
-	struct LinearMemoryArea : public MemoryArea {
-		using MemoryArea::MemoryArea;
-
-		virtual uint8_t peek(uint16_t addr) {
-			return m_data[addr];
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-			m_data[addr] = val;
-		}
+	const uint16_t PAGE_SIZE = 0x100;
+
+	enum PageKind : uint8_t {
+		// one byte per address
+		PAGE_LINEAR,
+		// one pixel per byte, each address is 2 pixels: low nibble first
+		PAGE_NIBBLE,
+		// reads from the linear data, writes go to the linear and the nibble data. lets 2 blocks
+		// of memory with different layouts appear to be the same block of memory
+		PAGE_DUAL,
+		// registers handled by functions
+		PAGE_IO,
+		// reads return value, writes are ignored. unmapped pages are constant 0
+		PAGE_CONSTANT,
 	};
 
-	struct LinearMemoryAreaDF : public MemoryArea {
-		using MemoryArea::MemoryArea;
-		bool m_isDirty = false;
-
-		virtual uint8_t peek(uint16_t addr) {
-			return m_data[addr];
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-			m_data[addr] = val;
-			m_isDirty = true;
-		}
-
-		void clearDirty() {
-			m_isDirty = false;
-		}
-
-		bool isDirty() {
-			return m_isDirty;
-		}
+	// converts between bytes and split nibble pixels, n is the number of bytes
+	void pack_nibbles(uint8_t* out, const uint8_t* pixels, size_t n);
+	void unpack_nibbles(uint8_t* pixels, const uint8_t* in, size_t n);
+
+	typedef uint8_t (*io_peek_t)(uint16_t addr);
+	typedef void (*io_poke_t)(uint16_t addr, uint8_t val);
+
+	// where a 256 byte page of the address space lives. data and nibbles point at the storage
+	// for the first address of the page.
+	struct Page {
+		PageKind kind = PAGE_CONSTANT;
+		uint8_t value = 0;
+		uint8_t* data = nullptr;
+		uint8_t* nibbles = nullptr;
+		io_peek_t io_peek = nullptr;
+		io_poke_t io_poke = nullptr;
 	};
 
-	struct All0MemoryArea : public MemoryArea {
-		using MemoryArea::MemoryArea;
-
-		virtual uint8_t peek(uint16_t addr) {
-			return 0;
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-		}
-	};
-
-	struct All1MemoryArea : public MemoryArea {
-		using MemoryArea::MemoryArea;
-
-		virtual uint8_t peek(uint16_t addr) {
-			return 0xff;
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-		}
-	};
-
-	struct SplitNibbleMemoryArea : public MemoryArea {
-		using MemoryArea::MemoryArea;
-
-		virtual uint8_t peek(uint16_t addr) {
-			return (m_data[addr * 2] & 0xf) | ((m_data[addr * 2 + 1] & 0xf) << 4);
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-			m_data[addr * 2 + 1] = val >> 4;
-			m_data[addr * 2] = val & 0xf;
-		}
-	};
-
-	// reads from primary, writes to primary & secondary
-	// allows 2 blocks of memory with diffent layouts
-	// appear to be the same block of memory
-	struct DualMemoryArea : public IMemoryArea {
+	// the address space as a table of page descriptors. peek and poke are inline, plain memory
+	// is accessed without any calls.
+	class RAM {
 	   private:
-		IMemoryArea* m_primary;
-		IMemoryArea* m_secondary;
+		std::array<Page, 256> m_pages;
 
-	   public:
-		DualMemoryArea(IMemoryArea* primary, IMemoryArea* secondary)
-		    : m_primary(primary), m_secondary(secondary) {
+		static uint8_t nibblePeek(const uint8_t* p) {
+			return (p[0] & 0xf) | ((p[1] & 0xf) << 4);
 		}
 
-		virtual uint16_t address() const {
-			return m_primary->address();
-		}
-		virtual uint16_t size() const {
-			return m_primary->size();
+		static void nibblePoke(uint8_t* p, uint8_t val) {
+			p[0] = val & 0xf;
+			p[1] = val >> 4;
 		}
 
-		virtual uint8_t peek(uint16_t addr) {
-			return m_primary->peek(addr);
-		}
-
-		virtual void poke(uint16_t addr, uint8_t val) {
-			m_primary->poke(addr, val);
-			m_secondary->poke(addr, val);
-		}
-	};
-
-	class RAM {
-	   private:
-		std::array<IMemoryArea*, 256> m_pages;
+		uint8_t* contiguous(uint16_t addr, uint32_t len, bool dual) const;
 
 	   public:
 		RAM();
-		void addMemoryArea(IMemoryArea* area);
-		uint8_t peek(uint16_t addr);
-		void poke(uint16_t addr, uint8_t val);
+
+		// address and size are multiples of the page size
+		void mapLinear(uint16_t address, uint16_t size, uint8_t* data);
+		void mapNibbles(uint16_t address, uint16_t size, uint8_t* data);
+		void mapDual(uint16_t address, uint16_t size, uint8_t* data, uint8_t* nibbles);
+		void mapIO(uint16_t address, uint16_t size, io_peek_t peek, io_poke_t poke);
+		void mapConstant(uint16_t address, uint16_t size, uint8_t value);
+
+		const Page& page(uint16_t addr) const {
+			return m_pages[addr >> 8];
+		}
+
+		uint8_t peek(uint16_t addr) const {
+			const Page& p = m_pages[addr >> 8];
+			uint8_t offset = uint8_t(addr);
+			if (p.kind == PAGE_LINEAR) {
+				return p.data[offset];
+			}
+			switch (p.kind) {
+				case PAGE_NIBBLE:
+					return nibblePeek(p.data + offset * 2);
+				case PAGE_DUAL:
+					return p.data[offset];
+				case PAGE_IO:
+					return p.io_peek(addr);
+				default:
+					return p.value;
+			}
+		}
+
+		void poke(uint16_t addr, uint8_t val) {
+			const Page& p = m_pages[addr >> 8];
+			uint8_t offset = uint8_t(addr);
+			if (p.kind == PAGE_LINEAR) {
+				p.data[offset] = val;
+				return;
+			}
+			switch (p.kind) {
+				case PAGE_NIBBLE:
+					nibblePoke(p.data + offset * 2, val);
+					break;
+				case PAGE_DUAL:
+					p.data[offset] = val;
+					nibblePoke(p.nibbles + offset * 2, val);
+					break;
+				case PAGE_IO:
+					p.io_poke(addr, val);
+					break;
+				default:
+					break;
+			}
+		}
+
+		// range versions of peek & poke, these work a page at a time. the range must not run past
+		// the end of the address space.
+		void read(uint16_t addr, uint8_t* out, uint32_t len) const;
+		void write(uint16_t addr, const uint8_t* in, uint32_t len);
+		void fill(uint16_t addr, uint8_t val, uint32_t len);
+
+		// the storage of a range that is all linear pages laid out one after the other, or
+		// nullptr if it is not. readable() also accepts dual pages, whose linear data is what
+		// reads return.
+		uint8_t* linear(uint16_t addr, uint32_t len) const;
+		const uint8_t* readable(uint16_t addr, uint32_t len) const;
+
 		void dump(uint16_t from, uint16_t len);
 	};
 }  // namespace pico_ram
@@ -2,12 +2,14 @@
 
 #include <assert.h>
 
+#include <algorithm>
 #include <cstring>
 #include <deque>
 #include <functional>
 #include <iostream>
 #include <set>
 #include <sstream>
+#include <vector>
 
 #include "firmware.lua"
 #include "pico_cart.h"
@@ -23,6 +25,9 @@ static std::deque<deferredAPICall_t> deferredAPICalls;
 
 static bool hook_funcs = false;
 
+static bool seed_random = false;
+static int32_t random_seed = 0;
+
 static void throw_error(int err) {
 	if (err) {
 		std::string msg = lua_tostring(lstate, -1);
@@ -111,9 +116,60 @@ static int impl_cls(lua_State* ls) {
 	return 0;
 }
 
+// peek(a, n), peek2(a, n) & peek4(a, n) return n values and poke(a, v1, v2, ...) etc. write
+// one value per argument, like pico 8 0.2. more than one value is moved with a single bulk
+// read or write, so a cart can decode packed data without a call per byte.
+static std::vector<uint8_t> peek_poke_buffer;
+
+// pushes n values of size bytes read from a
+static int peek_values(lua_State* ls, uint16_t a, int n, int size) {
+	if (n <= 0) {
+		return 0;
+	}
+	n = std::min(n, 8192);
+	luaL_checkstack(ls, n, "too many values to peek");
+	peek_poke_buffer.resize(n * size);
+	pico_api::memory_read(a, peek_poke_buffer.data(), n * size);
+
+	const uint8_t* p = peek_poke_buffer.data();
+	for (int i = 0; i < n; i++, p += size) {
+		uint32_t v = p[0];
+		if (size == 1) {
+			lua_pushnumber(ls, z8::fix32::frombits(v << 16));
+		} else if (size == 2) {
+			v |= uint32_t(p[1]) << 8;
+			lua_pushnumber(ls, z8::fix32::frombits(v << 16));
+		} else {
+			v |= (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+			lua_pushnumber(ls, z8::fix32::frombits(v));
+		}
+	}
+	return n;
+}
+
+// writes arguments 2 onwards to a as values of size bytes
+static void poke_values(lua_State* ls, uint16_t a, int size) {
+	int n = lua_gettop(ls) - 1;
+	peek_poke_buffer.resize(n * size);
+
+	uint8_t* p = peek_poke_buffer.data();
+	for (int i = 0; i < n; i++, p += size) {
+		auto v = luaL_checknumber(ls, i + 2);
+		uint32_t bits = size == 4 ? v.bits() : uint32_t(v.toInt());
+		for (int k = 0; k < size; k++) {
+			p[k] = uint8_t(bits >> (k * 8));
+		}
+	}
+	pico_api::memory_write(a, peek_poke_buffer.data(), n * size);
+}
+
 static int impl_poke(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (lua_gettop(ls) > 2) {
+		poke_values(ls, a, 1);
+		return 0;
+	}
 	auto v = luaL_checknumber(ls, 2).toInt();
 	pico_api::poke(a, v);
 	return 0;
@@ -122,6 +178,9 @@ static int impl_poke(lua_State* ls) {
 static int impl_peek(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (!lua_isnoneornil(ls, 2)) {
+		return peek_values(ls, a, luaL_checknumber(ls, 2).toInt(), 1);
+	}
 	uint32_t v = pico_api::peek(a);
 	lua_pushnumber(ls, z8::fix32::frombits(v << 16));
 	return 1;
@@ -130,6 +189,10 @@ static int impl_peek(lua_State* ls) {
 static int impl_poke2(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (lua_gettop(ls) > 2) {
+		poke_values(ls, a, 2);
+		return 0;
+	}
 	auto v = luaL_checknumber(ls, 2);
 	pico_api::poke2(a, v.toInt());
 	return 0;
@@ -138,6 +201,9 @@ static int impl_poke2(lua_State* ls) {
 static int impl_peek2(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (!lua_isnoneornil(ls, 2)) {
+		return peek_values(ls, a, luaL_checknumber(ls, 2).toInt(), 2);
+	}
 	uint32_t v = pico_api::peek2(a);
 	lua_pushnumber(ls, z8::fix32::frombits(v << 16));
 	return 1;
@@ -146,6 +212,10 @@ static int impl_peek2(lua_State* ls) {
 static int impl_poke4(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (lua_gettop(ls) > 2) {
+		poke_values(ls, a, 4);
+		return 0;
+	}
 	auto v = luaL_checknumber(ls, 2);
 	pico_api::poke4(a, v.bits());
 	return 0;
@@ -154,6 +224,9 @@ static int impl_poke4(lua_State* ls) {
 static int impl_peek4(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto a = luaL_checknumber(ls, 1).toInt();
+	if (!lua_isnoneornil(ls, 2)) {
+		return peek_values(ls, a, luaL_checknumber(ls, 2).toInt(), 4);
+	}
 	uint32_t v = pico_api::peek4(a);
 	lua_pushnumber(ls, z8::fix32::frombits(v));
 	return 1;
@@ -774,6 +847,20 @@ static int implx_gfxstate(lua_State* ls) {
 	return 0;
 }
 
+static int implx_drawbuffer(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto enable = lua_toboolean(ls, 1);
+	pico_apix::drawbuffer(enable);
+	return 0;
+}
+
+static int implx_mapcache(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto enable = lua_toboolean(ls, 1);
+	pico_apix::mapcache(enable);
+	return 0;
+}
+
 // dbg_getsrc (source, line)
 static int implx_dbg_getsrc(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
@@ -953,6 +1040,8 @@ static const luaL_Reg tac08_api[] = {{"wavload", implx_wavload},
                                      {"fonts", implx_fonts},
                                      {"window", implx_window},
                                      {"gfxstate", implx_gfxstate},
+                                     {"drawbuffer", implx_drawbuffer},
+                                     {"mapcache", implx_mapcache},
                                      {"dbg_getsrc", implx_dbg_getsrc},
                                      {"dbg_getsrclines", implx_dbg_getsrclines},
                                      {"dbg_cocreate", implx_dbg_cocreate},
@@ -975,6 +1064,16 @@ namespace pico_script {
 		unload_scripting();
 		init_scripting();
 
+		if (seed_random) {
+			lua_getglobal(lstate, "srand");
+			if (!lua_isfunction(lstate, -1)) {
+				lua_pop(lstate, 1);
+				throw pico_script::error("srand not found, can not seed rnd()");
+			}
+			lua_pushnumber(lstate, z8::fix32::frombits(uint32_t(random_seed) << 16));
+			throw_error(lua_pcall(lstate, 1, 0, 0));
+		}
+
 		std::string code;
 
 		for (size_t i = 0; i < cart.source.size(); i++) {
@@ -984,6 +1083,11 @@ namespace pico_script {
 		throw_error(lua_pcall(lstate, 0, 0, 0));
 	}
 
+	void set_random_seed(int32_t seed) {
+		seed_random = true;
+		random_seed = seed;
+	}
+
 	void unload_scripting() {
 		if (lstate) {
 			lua_close(lstate);
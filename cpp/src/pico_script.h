@@ -1,6 +1,8 @@
 #ifndef PICO_SCRIPT_H
 #define PICO_SCRIPT_H
 
+#include <stdint.h>
+
 #include <stdexcept>
 
 #include "string"
@@ -20,6 +22,9 @@ namespace pico_script {
 	void unload_scripting();
 	void tron();
 	void troff();
+	// calls srand(seed) every time a cart is loaded, so its random numbers are the same on
+	// every run. seed is a whole pico 8 number, only its low 16 bits are kept.
+	void set_random_seed(int32_t seed);
 
 }  // namespace pico_script
 
@@ -0,0 +1,35 @@
+#ifndef TAC08_SIMD_H
+#define TAC08_SIMD_H
+
+// selects the vector instruction sets available to the span kernels. the kernels are optional,
+// every user of these macros has a scalar fallback. define TAC08_NO_SIMD to force the scalar
+// code paths.
+//
+// on x86 the shuffle based kernels need at least SSSE3 (build with -mssse3 or -mavx2), a plain
+// x86-64 build only has SSE2. NEON is used automatically on ARM targets that have it.
+
+#ifndef TAC08_NO_SIMD
+
+#if defined(__AVX2__)
+#define TAC08_SIMD_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__SSSE3__)
+#define TAC08_SIMD_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TAC08_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TAC08_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#endif  // TAC08_NO_SIMD
+
+#endif /* TAC08_SIMD_H */
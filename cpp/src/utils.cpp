@@ -112,4 +112,87 @@ namespace utils {
 		}
 	}
 
+	static const uint64_t prime64_1 = 0x9e3779b185ebca87ULL;
+	static const uint64_t prime64_2 = 0xc2b2ae3d27d4eb4fULL;
+	static const uint64_t prime64_3 = 0x165667b19e3779f9ULL;
+	static const uint64_t prime64_4 = 0x85ebca77c2b2ae63ULL;
+	static const uint64_t prime64_5 = 0x27d4eb2f165667c5ULL;
+
+	static inline uint64_t rotl64(uint64_t v, int r) {
+		return (v << r) | (v >> (64 - r));
+	}
+
+	static inline uint64_t read64(const uint8_t* p) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static inline uint32_t read32(const uint8_t* p) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static inline uint64_t round64(uint64_t acc, uint64_t input) {
+		acc += input * prime64_2;
+		return rotl64(acc, 31) * prime64_1;
+	}
+
+	static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+		acc ^= round64(0, v);
+		return acc * prime64_1 + prime64_4;
+	}
+
+	// reads little endian words with memcpy, the result on big endian hosts differs from the
+	// reference implementation but is still stable.
+	uint64_t hash64(const void* data, size_t len, uint64_t seed) {
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		const uint8_t* end = p + len;
+		uint64_t h;
+
+		if (len >= 32) {
+			uint64_t v1 = seed + prime64_1 + prime64_2;
+			uint64_t v2 = seed + prime64_2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - prime64_1;
+			for (; p + 32 <= end; p += 32) {
+				v1 = round64(v1, read64(p));
+				v2 = round64(v2, read64(p + 8));
+				v3 = round64(v3, read64(p + 16));
+				v4 = round64(v4, read64(p + 24));
+			}
+			h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+			h = merge64(h, v1);
+			h = merge64(h, v2);
+			h = merge64(h, v3);
+			h = merge64(h, v4);
+		} else {
+			h = seed + prime64_5;
+		}
+
+		h += len;
+
+		for (; p + 8 <= end; p += 8) {
+			h ^= round64(0, read64(p));
+			h = rotl64(h, 27) * prime64_1 + prime64_4;
+		}
+		if (p + 4 <= end) {
+			h ^= uint64_t(read32(p)) * prime64_1;
+			h = rotl64(h, 23) * prime64_2 + prime64_3;
+			p += 4;
+		}
+		for (; p < end; p++) {
+			h ^= *p * prime64_5;
+			h = rotl64(h, 11) * prime64_1;
+		}
+
+		h ^= h >> 33;
+		h *= prime64_2;
+		h ^= h >> 29;
+		h *= prime64_3;
+		h ^= h >> 32;
+		return h;
+	}
+
 }  // namespace utils
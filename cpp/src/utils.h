@@ -1,6 +1,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -45,6 +47,9 @@ namespace utils {
 	                 std::vector<std::string>& output,
 	                 const char* sep_chars);
 
+	// 64 bit xxHash (XXH64) of len bytes, continuing from seed
+	uint64_t hash64(const void* data, size_t len, uint64_t seed = 0);
+
 }  // namespace utils
 
 #define STRINGIFY(x) #x
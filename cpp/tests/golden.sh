@@ -0,0 +1,39 @@
+#!/bin/sh
+# golden frame regression test. runs each test cart in the headless build for a fixed number
+# of frames in deterministic mode and compares the per frame screen hashes against the lists
+# in tests/golden. "golden.sh update" rewrites the lists, do that only when a change to the
+# output is intended.
+#
+# run from the cpp directory after "make headless", or use "make golden" / "make golden-update".
+
+EXE=${EXE:-./tac08_headless}
+FRAMES=${FRAMES:-300}
+CARTS=${CARTS:-"apitest1 coroutine exfont expal font geomtest oldfont paltest sspr stattest time zoomtest"}
+GOLDEN=tests/golden
+
+failed=0
+mkdir -p $GOLDEN
+for cart in $CARTS; do
+	hashes=$GOLDEN/$cart.hashes
+	if [ "$1" = "update" ]; then
+		# written to a temporary file first so a cart that fails to run keeps its old list
+		rm -f $hashes.new
+		if TAC08_DETERMINISTIC=1 TAC08_HEADLESS_FRAMES=$FRAMES TAC08_FRAME_HASHES=$hashes.new \
+			$EXE tests/$cart.p8 && [ -s $hashes.new ]; then
+			mv $hashes.new $hashes
+			echo "$cart: updated"
+		else
+			rm -f $hashes.new
+			echo "$cart: update failed"
+			failed=1
+		fi
+	elif [ ! -f "$hashes" ]; then
+		echo "$cart: no golden hashes, run golden.sh update"
+		failed=1
+	else
+		TAC08_DETERMINISTIC=1 TAC08_HEADLESS_FRAMES=$FRAMES TAC08_GOLDEN_HASHES=$hashes \
+			$EXE tests/$cart.p8 || failed=1
+	fi
+done
+
+exit $failed